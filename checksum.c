@@ -0,0 +1,224 @@
+/*
+ * checksum.c
+ *
+ * Per-block checksums for user space suspend and resume tools (CRC32C and
+ * xxHash64).
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <strings.h>
+#if defined(CONFIG_ARCH_X86) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+#include "checksum.h"
+
+/* CRC32C (Castagnoli), reflected polynomial */
+#define CRC32C_POLY	0x82F63B78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t size)
+{
+	while (size--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static uint64_t crc32c_generic(const void *buf, size_t size)
+{
+	return ~crc32c_sw(~0U, buf, size);
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse4.2")))
+static uint64_t crc32c_sse42(const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+	uint32_t crc = ~0U;
+#ifdef __x86_64__
+	uint64_t crc64 = crc, word;
+
+	for (; size >= sizeof(word); size -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += sizeof(word);
+	}
+	crc = crc64;
+#else
+	uint32_t word;
+
+	for (; size >= sizeof(word); size -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+		p += sizeof(word);
+	}
+#endif
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return ~crc;
+}
+#endif /* CHECKSUM_X86 */
+
+/* xxHash64 */
+#define XXH_PRIME1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3	0x165667B19E3779F9ULL
+#define XXH_PRIME4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t val;
+
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+	return (acc ^ xxh64_round(0, val)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static uint64_t xxh64(const void *buf, size_t size)
+{
+	const unsigned char *p = buf, *end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2;
+		uint64_t v3 = 0, v4 = -XXH_PRIME1;
+
+		do {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+			rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = XXH_PRIME5;
+	}
+	h += size;
+
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME1 +
+			XXH_PRIME4;
+	if (p + 4 <= end) {
+		uint32_t val;
+
+		memcpy(&val, p, sizeof(val));
+		h = rotl64(h ^ (val * XXH_PRIME1), 23) * XXH_PRIME2 +
+			XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	return h ^ (h >> 32);
+}
+
+static struct checksum_method methods[] = {
+	{
+		.name = "md5",
+		.id = CHECKSUM_MD5,
+		.compute = NULL,
+	},
+	{
+		.name = "crc32c",
+		.id = CHECKSUM_CRC32C,
+		.compute = crc32c_generic,
+	},
+	{
+		.name = "xxhash",
+		.id = CHECKSUM_XXH64,
+		.compute = xxh64,
+	},
+};
+
+#define NR_METHODS	(sizeof(methods) / sizeof(methods[0]))
+
+/**
+ *	checksum_init - prepare the checksum methods for use
+ *
+ *	Use the CRC32C instruction if the CPU has it, or generate the table for
+ *	computing CRC32C in software otherwise.
+ */
+void checksum_init(void)
+{
+	uint32_t crc;
+	int j, k;
+
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		methods[CHECKSUM_CRC32C].compute = crc32c_sse42;
+		return;
+	}
+#endif
+	for (j = 0; j < 256; j++) {
+		crc = j;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[j] = crc;
+	}
+}
+
+/**
+ *	find_checksum_method - find the checksum method with given ID
+ *	@id:	ID of the method, as stored in the image header.
+ *
+ *	Returns NULL if the method is not supported.
+ */
+const struct checksum_method *find_checksum_method(int id)
+{
+	unsigned int j;
+
+	for (j = 0; j < NR_METHODS; j++)
+		if (methods[j].id == id)
+			return methods + j;
+	return NULL;
+}
+
+/**
+ *	find_checksum_method_by_name - find the checksum method with given name
+ *	@name:	Name of the method, as used in the configuration file.
+ *
+ *	Returns NULL if the method is not supported.
+ */
+const struct checksum_method *find_checksum_method_by_name(const char *name)
+{
+	unsigned int j;
+
+	for (j = 0; j < NR_METHODS; j++)
+		if (!strcasecmp(methods[j].name, name))
+			return methods + j;
+	return NULL;
+}
@@ -0,0 +1,38 @@
+/*
+ * checksum.h
+ *
+ * Definitions of the methods used for checking the integrity of the image.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Checksum methods.  The ID of the method used for saving the image is stored
+ * in the image header, so these numbers must not change.
+ */
+#define CHECKSUM_MD5	0
+#define CHECKSUM_CRC32C	1
+#define CHECKSUM_XXH64	2
+
+/**
+ * struct checksum_method - method of computing image checksums
+ *
+ * @name:	Name of the method (used in the configuration file).
+ * @id:		ID of the method stored in the image header.
+ * @compute:	Compute the checksum of @size bytes at @buf.  If this is NULL,
+ *		the method is MD5, which is computed over the whole image
+ *		instead of over each block of data separately.
+ */
+struct checksum_method {
+	const char *name;
+	int id;
+	uint64_t (*compute)(const void *buf, size_t size);
+};
+
+void checksum_init(void);
+const struct checksum_method *find_checksum_method(int id);
+const struct checksum_method *find_checksum_method_by_name(const char *name);
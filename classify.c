@@ -0,0 +1,435 @@
+/*
+ * classify.c
+ *
+ * Detection of image data pages that contain mostly zeros or duplicate
+ * recently saved pages and conversion of them to (and from) compact page
+ * records.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#if defined(CONFIG_ARCH_X86) && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define CLASSIFY_X86
+#include <immintrin.h>
+#endif
+
+#include "memalloc.h"
+#include "classify.h"
+
+/*
+ * Each scan function below sets the bits in @bitmap (which has to be zeroed
+ * in advance) corresponding to the nonzero 8-byte words in @words and returns
+ * the number of those words.  It may stop and return a number greater than
+ * @limit as soon as there are more than @limit nonzero words.  @nr is a
+ * multiple of 64.
+ */
+typedef unsigned int (*scan_fn)(const uint64_t *words, unsigned int nr,
+				unsigned char *bitmap, unsigned int limit);
+
+static unsigned int scan_words(const uint64_t *words, unsigned int nr,
+				unsigned char *bitmap, unsigned int limit)
+{
+	unsigned int j, n = 0;
+
+	for (j = 0; j < nr; j++)
+		if (words[j]) {
+			bitmap[j >> 3] |= 1 << (j & 7);
+			if (++n > limit)
+				break;
+		}
+	return n;
+}
+
+#ifdef CLASSIFY_X86
+/* Returns a mask with bits set for the nonzero words among the 2 at @p */
+__attribute__((target("sse2")))
+static inline unsigned int sse2_mask(const uint64_t *p, __m128i zero)
+{
+	unsigned int m;
+
+	m = _mm_movemask_epi8(_mm_cmpeq_epi32(
+				_mm_loadu_si128((const __m128i *)p), zero));
+	return ((m & 0xff) != 0xff) | (((m >> 8) != 0xff) << 1);
+}
+
+__attribute__((target("sse2")))
+static unsigned int scan_words_sse2(const uint64_t *words, unsigned int nr,
+				unsigned char *bitmap, unsigned int limit)
+{
+	__m128i zero = _mm_setzero_si128();
+	unsigned int j, n = 0, b;
+
+	for (j = 0; j < nr; j += 8) {
+		b = sse2_mask(words + j, zero) |
+			(sse2_mask(words + j + 2, zero) << 2) |
+			(sse2_mask(words + j + 4, zero) << 4) |
+			(sse2_mask(words + j + 6, zero) << 6);
+		if (b) {
+			bitmap[j >> 3] = b;
+			n += __builtin_popcount(b);
+			if (n > limit)
+				break;
+		}
+	}
+	return n;
+}
+
+__attribute__((target("avx2")))
+static unsigned int scan_words_avx2(const uint64_t *words, unsigned int nr,
+				unsigned char *bitmap, unsigned int limit)
+{
+	__m256i zero = _mm256_setzero_si256();
+	unsigned int j, n = 0, b;
+
+	for (j = 0; j < nr; j += 8) {
+		b = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+			_mm256_loadu_si256((const __m256i *)(words + j)),
+			zero)));
+		b |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(
+			_mm256_loadu_si256((const __m256i *)(words + j + 4)),
+			zero))) << 4;
+		/* The bits are set for the zero words, so invert them */
+		b ^= 0xff;
+		if (b) {
+			bitmap[j >> 3] = b;
+			n += __builtin_popcount(b);
+			if (n > limit)
+				break;
+		}
+	}
+	return n;
+}
+#endif /* CLASSIFY_X86 */
+
+static scan_fn scan = scan_words;
+
+/*
+ * The page hash only has to be fast, because pages with matching hashes are
+ * compared with each other before being regarded as duplicates.
+ */
+#define HASH_PRIME1	0x9E3779B185EBCA87ULL
+#define HASH_PRIME2	0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3	0x165667B19E3779F9ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t word)
+{
+	return rotl64(acc + word * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+/* Hash @nr 8-byte words at @words, @nr has to be a multiple of 4 */
+static uint64_t hash_page(const uint64_t *words, unsigned int nr)
+{
+	uint64_t h0 = HASH_PRIME1, h1 = HASH_PRIME2, h2 = 0, h3 = HASH_PRIME3;
+	uint64_t h;
+	unsigned int j;
+
+	for (j = 0; j < nr; j += 4) {
+		h0 = hash_round(h0, words[j]);
+		h1 = hash_round(h1, words[j + 1]);
+		h2 = hash_round(h2, words[j + 2]);
+		h3 = hash_round(h3, words[j + 3]);
+	}
+	h = rotl64(h0, 1) + rotl64(h1, 7) + rotl64(h2, 12) + rotl64(h3, 18);
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	return h ^ (h >> 32);
+}
+
+/**
+ *	classify_init - select the fastest page scanning method available
+ */
+void classify_init(void)
+{
+#ifdef CLASSIFY_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_words_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan = scan_words_sse2;
+#endif
+}
+
+#define DEDUP_EMPTY	0xffffffffU
+
+/*
+ * Number of hash table entries.  Only the pages in the cache are in the table,
+ * which is kept at most half full.
+ */
+#define DEDUP_TABLE_SIZE	(2 * PAGE_CACHE_SLOTS)
+
+/**
+ *	page_cache_size - memory needed for the page cache
+ *	@save:		Set if the cache is going to be used for saving the
+ *			image, which also needs the hash table.
+ */
+size_t page_cache_size(int save)
+{
+	size_t size = PAGE_CACHE_SLOTS * page_size;
+
+	if (save) {
+		size += round_up_page_size(PAGE_CACHE_SLOTS * sizeof(uint64_t));
+		size += round_up_page_size(DEDUP_TABLE_SIZE *
+					sizeof(struct dedup_entry));
+	}
+	return size;
+}
+
+/**
+ *	init_page_cache - allocate memory for the page cache and initialize it
+ *	@cache:		Structure to initialize.
+ *	@save:		Set if the cache is going to be used for saving the
+ *			image, which also needs the hash table.
+ */
+int init_page_cache(struct page_cache *cache, int save)
+{
+	cache->hashes = NULL;
+	cache->table = NULL;
+	cache->table_mask = 0;
+	cache->next = 0;
+	cache->nr_used = 0;
+	cache->nr_dups = 0;
+	cache->pages = getmem(PAGE_CACHE_SLOTS * page_size);
+	if (!cache->pages)
+		return -ENOMEM;
+	if (!save)
+		return 0;
+
+	cache->hashes = getmem(PAGE_CACHE_SLOTS * sizeof(uint64_t));
+	cache->table = getmem(DEDUP_TABLE_SIZE * sizeof(struct dedup_entry));
+	if (!cache->hashes || !cache->table) {
+		free_page_cache(cache);
+		return -ENOMEM;
+	}
+	memset(cache->table, 0xff,
+		DEDUP_TABLE_SIZE * sizeof(struct dedup_entry));
+	cache->table_mask = DEDUP_TABLE_SIZE - 1;
+	return 0;
+}
+
+/**
+ *	free_page_cache - free memory used by the page cache
+ */
+void free_page_cache(struct page_cache *cache)
+{
+	if (cache->table)
+		freemem(cache->table);
+	if (cache->hashes)
+		freemem(cache->hashes);
+	freemem(cache->pages);
+	cache->table = NULL;
+	cache->hashes = NULL;
+	cache->pages = NULL;
+}
+
+static inline void *cache_page(struct page_cache *cache, unsigned int slot)
+{
+	return (char *)cache->pages + (size_t)slot * page_size;
+}
+
+/**
+ *	table_delete - remove an entry from the hash table
+ *
+ *	Move the entries that would become unreachable otherwise into the gap
+ *	left by the removed one.
+ */
+static void table_delete(struct page_cache *cache, unsigned int i)
+{
+	struct dedup_entry *table = cache->table;
+	unsigned int mask = cache->table_mask, j = i, k;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (table[j].slot == DEDUP_EMPTY)
+			break;
+		k = table[j].hash & mask;
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].slot = DEDUP_EMPTY;
+}
+
+/**
+ *	dedup_page - look for a page in the page cache
+ *	@cache:		Page cache to use.
+ *	@rec:		Page record whose header is to be filled in, the page
+ *			data follow the header.
+ *
+ *	If the page is a duplicate of one of the pages in the cache, convert
+ *	it into a reference to that page.  Otherwise, replace the oldest page
+ *	in the cache with it.
+ *
+ *	Returns the size of the resulting record.
+ */
+static size_t dedup_page(struct page_cache *cache, struct page_record *rec)
+{
+	struct dedup_entry *table = cache->table;
+	uint64_t *words = (uint64_t *)(rec + 1);
+	unsigned int mask = cache->table_mask, nr_slots, slot, i;
+	uint64_t hash;
+
+	hash = hash_page(words, page_size / sizeof(uint64_t));
+	for (i = hash & mask; table[i].slot != DEDUP_EMPTY; i = (i + 1) & mask)
+		if (table[i].hash == hash && !memcmp(words,
+				cache_page(cache, table[i].slot), page_size)) {
+			rec->type = PAGE_DUP;
+			rec->slot = table[i].slot;
+			cache->nr_dups++;
+			return PAGE_RECORD_HEADER_SIZE;
+		}
+
+	/* The hash table cannot be more than half full */
+	nr_slots = (mask + 1) / 2;
+	if (nr_slots > PAGE_CACHE_SLOTS)
+		nr_slots = PAGE_CACHE_SLOTS;
+	slot = cache->next;
+	if (cache->nr_used < nr_slots) {
+		cache->nr_used++;
+	} else {
+		i = cache->hashes[slot] & mask;
+		while (table[i].slot != slot && table[i].slot != DEDUP_EMPTY)
+			i = (i + 1) & mask;
+		if (table[i].slot == slot)
+			table_delete(cache, i);
+	}
+	for (i = hash & mask; table[i].slot != DEDUP_EMPTY; i = (i + 1) & mask)
+		;
+	table[i].hash = hash;
+	table[i].slot = slot;
+	cache->hashes[slot] = hash;
+	memcpy(cache_page(cache, slot), words, page_size);
+	cache->next = (slot + 1) % nr_slots;
+
+	rec->type = PAGE_CACHED;
+	rec->slot = slot;
+	return PAGE_RECORD_HEADER_SIZE + page_size;
+}
+
+/**
+ *	pack_page - convert an image data page into a page record in place
+ *	@record:	Page record whose header is to be filled in, the page
+ *			data follow the header.
+ *	@cache:		Page cache to use for finding duplicate pages or NULL.
+ *
+ *	Returns the size of the resulting record.
+ */
+size_t pack_page(void *record, struct page_cache *cache)
+{
+	struct page_record *rec = record;
+	uint64_t *words = (uint64_t *)(rec + 1);
+	unsigned char bitmap[PAGE_BITMAP_MAX];
+	unsigned int nr_words = page_size / sizeof(uint64_t);
+	unsigned int bitmap_size = nr_words / 8;
+	unsigned int n, j, k, b;
+
+	memset(bitmap, 0, bitmap_size);
+	n = scan(words, nr_words, bitmap, nr_words / SPARSE_WORDS_DIVISOR);
+	if (!n) {
+		rec->type = PAGE_ZERO;
+		rec->nr_words = 0;
+		return PAGE_RECORD_HEADER_SIZE;
+	}
+	if (n > nr_words / SPARSE_WORDS_DIVISOR) {
+		if (cache)
+			return dedup_page(cache, rec);
+		rec->type = PAGE_FULL;
+		rec->nr_words = nr_words;
+		return PAGE_RECORD_HEADER_SIZE + page_size;
+	}
+	/*
+	 * Move the nonzero words to the beginning of the page data.  That
+	 * can be done in place, because no word moves forward.
+	 */
+	for (j = 0, k = 0; j < bitmap_size; j++)
+		for (b = bitmap[j]; b; b &= b - 1)
+			words[k++] = words[j * 8 + __builtin_ctz(b)];
+	memcpy(words + n, bitmap, bitmap_size);
+	rec->type = PAGE_SPARSE;
+	rec->nr_words = n;
+	return PAGE_RECORD_HEADER_SIZE + n * sizeof(uint64_t) + bitmap_size;
+}
+
+/**
+ *	unpack_page - get the contents of an image data page out of a page
+ *			record
+ *	@record:	Page record to unpack.
+ *	@size:		Number of bytes available at @record.
+ *	@page:		Buffer to expand the page into, if necessary.
+ *	@cache:		Page cache to resolve references to duplicate pages
+ *			with or NULL.
+ *	@data:		Location to store the address of the page data in
+ *			(@page, the address of the page data inside of
+ *			@record or the address of a page in @cache).
+ *
+ *	Returns the size of the record or -EINVAL if it is not valid.
+ */
+ssize_t unpack_page(void *record, size_t size, void *page,
+			struct page_cache *cache, void **data)
+{
+	struct page_record *rec = record;
+	uint64_t *words = (uint64_t *)(rec + 1);
+	uint64_t *dst = page;
+	unsigned char *bitmap;
+	unsigned int nr_words = page_size / sizeof(uint64_t);
+	unsigned int bitmap_size = nr_words / 8;
+	unsigned int j, k, b;
+	size_t len;
+
+	if (size < PAGE_RECORD_HEADER_SIZE)
+		return -EINVAL;
+
+	switch (rec->type) {
+	case PAGE_FULL:
+		len = PAGE_RECORD_HEADER_SIZE + page_size;
+		if (size < len)
+			return -EINVAL;
+		*data = words;
+		return len;
+	case PAGE_ZERO:
+		memset(page, 0, page_size);
+		*data = page;
+		return PAGE_RECORD_HEADER_SIZE;
+	case PAGE_SPARSE:
+		if (rec->nr_words > nr_words)
+			return -EINVAL;
+		len = PAGE_RECORD_HEADER_SIZE +
+			rec->nr_words * sizeof(uint64_t) + bitmap_size;
+		if (size < len)
+			return -EINVAL;
+		memset(page, 0, page_size);
+		bitmap = (unsigned char *)(words + rec->nr_words);
+		for (j = 0, k = 0; j < bitmap_size; j++)
+			for (b = bitmap[j]; b && k < rec->nr_words; b &= b - 1)
+				dst[j * 8 + __builtin_ctz(b)] = words[k++];
+		*data = page;
+		return len;
+	case PAGE_CACHED:
+		len = PAGE_RECORD_HEADER_SIZE + page_size;
+		if (!cache || rec->slot >= PAGE_CACHE_SLOTS || size < len)
+			return -EINVAL;
+		memcpy(cache_page(cache, rec->slot), words, page_size);
+		*data = words;
+		return len;
+	case PAGE_DUP:
+		if (!cache || rec->slot >= PAGE_CACHE_SLOTS)
+			return -EINVAL;
+		*data = cache_page(cache, rec->slot);
+		return PAGE_RECORD_HEADER_SIZE;
+	}
+	return -EINVAL;
+}
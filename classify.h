@@ -0,0 +1,106 @@
+/*
+ * classify.h
+ *
+ * Definitions of the compact records representing image data pages that
+ * contain mostly zeros.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * If the IMAGE_SPARSE_PAGES header flag is set, the (uncompressed) contents of
+ * each image data block are a sequence of page records.  Each of them starts
+ * with struct page_record and is followed by:
+ *
+ * PAGE_FULL	- page_size bytes of page data,
+ * PAGE_ZERO	- nothing,
+ * PAGE_SPARSE	- the nonzero 8-byte words of the page (nr_words of them),
+ *		  followed by a bitmap with one bit per 8-byte word of the page
+ *		  (set if the word is nonzero).
+ *
+ * If the IMAGE_DEDUP_PAGES header flag is also set, the records may be:
+ *
+ * PAGE_CACHED	- page_size bytes of page data that also have to be stored in
+ *		  the page cache slot number @slot,
+ * PAGE_DUP	- nothing, the page data are in the page cache slot number
+ *		  @slot.
+ *
+ * All records are multiples of 8 bytes long.
+ */
+struct page_record {
+	uint32_t type;
+	union {
+		uint32_t nr_words;
+		uint32_t slot;
+	};
+};
+
+#define PAGE_FULL	0
+#define PAGE_ZERO	1
+#define PAGE_SPARSE	2
+#define PAGE_CACHED	3
+#define PAGE_DUP	4
+
+#define PAGE_RECORD_HEADER_SIZE	sizeof(struct page_record)
+
+/* The maximum size of the bitmap, enough for 64 KB pages */
+#define PAGE_BITMAP_MAX		1024
+
+/* Pages with more than 1/4 of nonzero words are not treated as sparse */
+#define SPARSE_WORDS_DIVISOR	4
+
+/*
+ * Number of recently saved pages kept by s2disk and resume in order to
+ * eliminate duplicate pages.  Only duplicates of these pages can be found, so
+ * that both of them need a fixed amount of memory regardless of the image
+ * size and resume can resolve every reference without reading the image
+ * again.
+ */
+#define PAGE_CACHE_SLOTS	1024
+
+struct dedup_entry {
+	uint64_t hash;
+	uint32_t slot;
+	uint32_t pad;
+};
+
+/*
+ * The page cache structure is used for finding duplicate pages (s2disk) and
+ * for resolving the references to them (resume).
+ *
+ * @pages:	PAGE_CACHE_SLOTS pages of data.
+ *
+ * @hashes:	Hashes of the pages in @pages (s2disk only).
+ *
+ * @table:	Open addressing hash table mapping page hashes to slots in
+ *		@pages (s2disk only).
+ *
+ * @table_mask:	Number of entries in @table minus one.
+ *
+ * @next:	The slot to store the next page in.
+ *
+ * @nr_used:	Number of slots used so far.
+ *
+ * @nr_dups:	Number of duplicate pages found.
+ */
+struct page_cache {
+	void *pages;
+	uint64_t *hashes;
+	struct dedup_entry *table;
+	unsigned int table_mask;
+	unsigned int next;
+	unsigned int nr_used;
+	unsigned long nr_dups;
+};
+
+void classify_init(void);
+size_t page_cache_size(int save);
+int init_page_cache(struct page_cache *cache, int save);
+void free_page_cache(struct page_cache *cache);
+size_t pack_page(void *record, struct page_cache *cache);
+ssize_t unpack_page(void *record, size_t size, void *page,
+			struct page_cache *cache, void **data);
@@ -0,0 +1,348 @@
+/*
+ * compress.c
+ *
+ * Compression methods for the suspend and resume tools
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+
+#ifdef CONFIG_COMPRESS
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <lzo/lzo1x.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef CONFIG_ZSTD
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+static int lzo_compressor_init(void)
+{
+	return lzo_init() == LZO_E_OK ? 0 : -EFAULT;
+}
+
+/* The worst-case expansion for LZO1 is size / 16 + 67 */
+static size_t lzo_bound(size_t size)
+{
+	return size + (size >> 4) + 67;
+}
+
+static size_t lzo_work_size(int level, size_t size)
+{
+	(void)level;
+	(void)size;
+	return LZO1X_1_MEM_COMPRESS;
+}
+
+static size_t lzo_decompress_work_size(void)
+{
+	return 0;
+}
+
+static ssize_t lzo_compress(void *src, size_t size, void *dst, size_t dst_size,
+			int level, void *work, size_t work_size)
+{
+	lzo_uint cnt;
+
+	(void)level;
+	(void)work_size;
+	if (dst_size < lzo_bound(size))
+		return -ENOSPC;
+	if (lzo1x_1_compress(src, size, dst, &cnt, work) != LZO_E_OK)
+		return -EFAULT;
+	return cnt;
+}
+
+static ssize_t lzo_decompress(void *src, size_t size, void *dst,
+			size_t dst_size, void *work, size_t work_size)
+{
+	lzo_uint cnt = dst_size;
+
+	(void)work;
+	(void)work_size;
+	if (lzo1x_decompress_safe(src, size, dst, &cnt, NULL) != LZO_E_OK)
+		return -EINVAL;
+	return cnt;
+}
+
+#ifdef CONFIG_LZ4
+static int lz4_init(void)
+{
+	return 0;
+}
+
+/* LZ4_compressBound() only works for sizes that fit in an int */
+static size_t lz4_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static size_t lz4_work_size(int level, size_t size)
+{
+	(void)size;
+	return level < LZ4HC_CLEVEL_MIN ?
+		LZ4_sizeofState() : LZ4_sizeofStateHC();
+}
+
+static size_t lz4_decompress_work_size(void)
+{
+	return 0;
+}
+
+/*
+ * Level 1 means the fast LZ4 compressor, higher levels are passed to the
+ * LZ4 HC compressor (both produce data in the same format).
+ */
+static ssize_t lz4_compress(void *src, size_t size, void *dst, size_t dst_size,
+			int level, void *work, size_t work_size)
+{
+	int cnt;
+
+	(void)work_size;
+	if (level < LZ4HC_CLEVEL_MIN)
+		cnt = LZ4_compress_fast_extState(work, src, dst, size,
+						dst_size, 1);
+	else
+		cnt = LZ4_compress_HC_extStateHC(work, src, dst, size,
+						dst_size, level);
+	return cnt > 0 ? cnt : -EFAULT;
+}
+
+static ssize_t lz4_decompress(void *src, size_t size, void *dst,
+			size_t dst_size, void *work, size_t work_size)
+{
+	int cnt;
+
+	(void)work;
+	(void)work_size;
+	cnt = LZ4_decompress_safe(src, dst, size, dst_size);
+	return cnt >= 0 ? cnt : -EINVAL;
+}
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_ZSTD
+static int zstd_init(void)
+{
+	return 0;
+}
+
+static size_t zstd_bound(size_t size)
+{
+	return ZSTD_compressBound(size);
+}
+
+/*
+ * The compression context is allocated statically out of the work memory, so
+ * that the usual memory allocation rules apply.  Its size depends on the
+ * compression parameters, which in turn depend on the level and on the
+ * (maximum) size of the input.
+ */
+static size_t zstd_work_size(int level, size_t size)
+{
+	return ZSTD_estimateCCtxSize_usingCParams(
+				ZSTD_getCParams(level, size, 0));
+}
+
+static size_t zstd_decompress_work_size(void)
+{
+	return ZSTD_estimateDCtxSize();
+}
+
+static ssize_t zstd_compress(void *src, size_t size, void *dst, size_t dst_size,
+			int level, void *work, size_t work_size)
+{
+	ZSTD_CCtx *cctx;
+	size_t cnt;
+
+	cctx = ZSTD_initStaticCCtx(work, work_size);
+	if (!cctx)
+		return -ENOMEM;
+	cnt = ZSTD_compressCCtx(cctx, dst, dst_size, src, size, level);
+	return ZSTD_isError(cnt) ? -EFAULT : (ssize_t)cnt;
+}
+
+static ssize_t zstd_decompress(void *src, size_t size, void *dst,
+			size_t dst_size, void *work, size_t work_size)
+{
+	ZSTD_DCtx *dctx;
+	size_t cnt;
+
+	dctx = ZSTD_initStaticDCtx(work, work_size);
+	if (!dctx)
+		return -ENOMEM;
+	cnt = ZSTD_decompressDCtx(dctx, dst, dst_size, src, size);
+	return ZSTD_isError(cnt) ? -EINVAL : (ssize_t)cnt;
+}
+#endif /* CONFIG_ZSTD */
+
+static const struct compressor compressors[] = {
+	{
+		.name = "lzo",
+		.id = COMPRESS_LZO,
+		.min_level = 1,
+		.max_level = 1,
+		.default_level = 1,
+		.init = lzo_compressor_init,
+		.bound = lzo_bound,
+		.work_size = lzo_work_size,
+		.decompress_work_size = lzo_decompress_work_size,
+		.compress = lzo_compress,
+		.decompress = lzo_decompress,
+	},
+#ifdef CONFIG_LZ4
+	{
+		.name = "lz4",
+		.id = COMPRESS_LZ4,
+		.min_level = 1,
+		.max_level = LZ4HC_CLEVEL_MAX,
+		.default_level = 1,
+		.init = lz4_init,
+		.bound = lz4_bound,
+		.work_size = lz4_work_size,
+		.decompress_work_size = lz4_decompress_work_size,
+		.compress = lz4_compress,
+		.decompress = lz4_decompress,
+	},
+#endif
+#ifdef CONFIG_ZSTD
+	{
+		.name = "zstd",
+		.id = COMPRESS_ZSTD,
+		.min_level = 1,
+		.max_level = 19,
+		.default_level = ZSTD_CLEVEL_DEFAULT,
+		.init = zstd_init,
+		.bound = zstd_bound,
+		.work_size = zstd_work_size,
+		.decompress_work_size = zstd_decompress_work_size,
+		.compress = zstd_compress,
+		.decompress = zstd_decompress,
+	},
+#endif
+};
+
+#define NR_COMPRESSORS	(sizeof(compressors) / sizeof(compressors[0]))
+
+/**
+ *	find_compressor - find the compression method with given ID
+ *	@id:	ID of the method, as stored in the image header.
+ *
+ *	Returns NULL if the method is not supported.
+ */
+const struct compressor *find_compressor(int id)
+{
+	unsigned int j;
+
+	for (j = 0; j < NR_COMPRESSORS; j++)
+		if (compressors[j].id == id)
+			return compressors + j;
+	return NULL;
+}
+
+/**
+ *	find_compressor_by_name - find the compression method with given name
+ *	@name:	Name of the method, as used in the configuration file.
+ *
+ *	Returns NULL if the method is not supported.
+ */
+const struct compressor *find_compressor_by_name(const char *name)
+{
+	unsigned int j;
+
+	for (j = 0; j < NR_COMPRESSORS; j++)
+		if (!strcasecmp(compressors[j].name, name))
+			return compressors + j;
+	return NULL;
+}
+
+/**
+ *	max_compressed_size - worst-case size of the compressed data
+ *	@size:	Number of bytes to compress.
+ *
+ *	Returns the maximum size of the compressed data over all of the
+ *	supported compression methods.  This is needed by the resume tool,
+ *	which doesn't know the method used for saving the image until it
+ *	has read the image header.
+ */
+size_t max_compressed_size(size_t size)
+{
+	size_t ret = 0, s;
+	unsigned int j;
+
+	for (j = 0; j < NR_COMPRESSORS; j++) {
+		s = compressors[j].bound(size);
+		if (s > ret)
+			ret = s;
+	}
+	return ret;
+}
+
+/**
+ *	max_decompress_work_size - maximum size of the decompression work memory
+ *
+ *	Returns the maximum size of the work memory needed for decompression
+ *	over all of the supported compression methods.
+ */
+size_t max_decompress_work_size(void)
+{
+	size_t ret = 0, s;
+	unsigned int j;
+
+	for (j = 0; j < NR_COMPRESSORS; j++) {
+		s = compressors[j].decompress_work_size();
+		if (s > ret)
+			ret = s;
+	}
+	return ret;
+}
+
+/* Number and size of the chunks of data sampled by probe_incompressible() */
+#define PROBE_CHUNKS	64
+#define PROBE_CHUNK	32
+
+/**
+ *	probe_incompressible - check if data are likely to be incompressible
+ *	@buf:	Data to check.
+ *	@size:	Number of bytes in @buf.
+ *
+ *	Sample PROBE_CHUNKS chunks of @buf evenly and compute the sum of the
+ *	squares of the byte value counts in the sample.  For n bytes of random
+ *	(or already compressed, or encrypted) data that sum is close to
+ *	n * (n + 255) / 256, while it is much greater than that for the data
+ *	that can be compressed.  This is way cheaper than trying to compress
+ *	the data and doesn't depend on the compression method.
+ */
+int probe_incompressible(const void *buf, size_t size)
+{
+	const unsigned char *data = buf;
+	unsigned int count[256];
+	unsigned long n = 0, sum = 0;
+	size_t stride, offset;
+	int j;
+
+	if (size < PROBE_CHUNKS * PROBE_CHUNK)
+		return 0;
+
+	memset(count, 0, sizeof(count));
+	stride = size / PROBE_CHUNKS;
+	for (offset = 0; offset + PROBE_CHUNK <= size; offset += stride) {
+		for (j = 0; j < PROBE_CHUNK; j++)
+			count[data[offset + j]]++;
+		n += PROBE_CHUNK;
+	}
+	for (j = 0; j < 256; j++)
+		sum += (unsigned long)count[j] * count[j];
+
+	/* Allow for up to 1/8 above the value expected for random data */
+	return sum * 256 < n * (n + 255) + n * n / 8;
+}
+#endif /* CONFIG_COMPRESS */
@@ -0,0 +1,67 @@
+/*
+ * compress.h
+ *
+ * Compression-related definitions for user space suspend and resume
+ * tools.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#ifdef CONFIG_COMPRESS
+#include <sys/types.h>
+
+/*
+ * Compression methods.  The ID of the method used for saving the image is
+ * stored in the image header, so these numbers must not change.
+ */
+#define COMPRESS_LZO	0
+#define COMPRESS_LZ4	1
+#define COMPRESS_ZSTD	2
+
+/**
+ * struct compressor - compression method used for the image data
+ *
+ * @name:		Name of the method (used in the configuration file).
+ * @id:			ID of the method stored in the image header.
+ * @min_level:		Minimum compression level.
+ * @max_level:		Maximum compression level.
+ * @default_level:	Compression level used if none is specified.
+ * @init:		Initialize the library used by the method.
+ * @bound:		Worst-case size of the compressed data for a given
+ *			number of input bytes.
+ * @work_size:		Size of the work memory needed for compressing a given
+ *			number of bytes at a given level.
+ * @decompress_work_size:	Size of the work memory needed for
+ *			decompression.
+ * @compress:		Compress @size bytes at @src into @dst (that can hold
+ *			up to @dst_size bytes) using @work (@work_size bytes)
+ *			as the work memory.  Return the number of compressed
+ *			bytes or a negative error code.
+ * @decompress:		Decompress @size bytes at @src into @dst (that can hold
+ *			up to @dst_size bytes) using @work (@work_size bytes)
+ *			as the work memory.  Return the number of decompressed
+ *			bytes or a negative error code.
+ */
+struct compressor {
+	const char *name;
+	int id;
+	int min_level;
+	int max_level;
+	int default_level;
+	int (*init)(void);
+	size_t (*bound)(size_t size);
+	size_t (*work_size)(int level, size_t size);
+	size_t (*decompress_work_size)(void);
+	ssize_t (*compress)(void *src, size_t size, void *dst, size_t dst_size,
+			int level, void *work, size_t work_size);
+	ssize_t (*decompress)(void *src, size_t size, void *dst,
+			size_t dst_size, void *work, size_t work_size);
+};
+
+const struct compressor *find_compressor(int id);
+const struct compressor *find_compressor_by_name(const char *name);
+size_t max_compressed_size(size_t size);
+size_t max_decompress_work_size(void);
+int probe_incompressible(const void *buf, size_t size);
+#endif
@@ -93,5 +93,45 @@ void get_random_salt(unsigned char *salt, size_t size)
 		close(fd);
 	}
 }
+
+/**
+ *	open_image_cipher - open the cipher used for image encryption
+ *	@hd:	Location to store the cipher handle in.
+ *	@aes:	If set, use IMAGE_CIPHER_AES in the CTR mode, otherwise use
+ *		IMAGE_CIPHER in the CFB mode.
+ */
+int open_image_cipher(gcry_cipher_hd_t *hd, int aes)
+{
+	if (aes)
+		return gcry_cipher_open(hd, IMAGE_CIPHER_AES,
+				GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
+
+	return gcry_cipher_open(hd, IMAGE_CIPHER, GCRY_CIPHER_MODE_CFB,
+				GCRY_CIPHER_SECURE);
+}
+
+/**
+ *	set_block_counter - prepare the CTR mode cipher for a block of image
+ *			data
+ *	@hd:	Cipher handle.
+ *	@ivec:	Initialization vector of the image (CIPHER_BLOCK bytes).
+ *	@index:	Index of the block in the image.
+ *
+ *	The counter is made of @ivec, @index (32 bits) and 32 zero bits, so the
+ *	ranges of counter values used for different blocks never overlap and
+ *	each block can be encrypted and decrypted independently of the others.
+ */
+int set_block_counter(gcry_cipher_hd_t hd, const unsigned char *ivec,
+			unsigned long index)
+{
+	unsigned char ctr[AES_BLOCK];
+	int j;
+
+	memset(ctr, 0, AES_BLOCK);
+	memcpy(ctr, ivec, CIPHER_BLOCK);
+	for (j = 0; j < 4; j++)
+		ctr[CIPHER_BLOCK + j] = index >> (24 - 8 * j);
+	return gcry_cipher_setctr(hd, ctr, AES_BLOCK);
+}
 #endif
 
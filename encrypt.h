@@ -22,6 +22,12 @@
 #define IMAGE_CIPHER	GCRY_CIPHER_BLOWFISH
 #define KEY_SIZE	16
 #define CIPHER_BLOCK	8
+/* Symmetric cipher used for image encryption if the IMAGE_AES_CTR header flag
+ * is set (it uses the same key and initialization vector as IMAGE_CIPHER) and
+ * the size of its block, in bytes
+ */
+#define IMAGE_CIPHER_AES	GCRY_CIPHER_AES128
+#define AES_BLOCK	16
 /* Symmetric cipher used for encrypting RSA private keys, the size of its key
  * and its block, in bytes
  */
@@ -58,9 +64,11 @@ struct key_data {
 void read_password(char *pass_buf, int vrfy);
 void encrypt_init(unsigned char *, unsigned char *, char *);
 void get_random_salt(unsigned char *salt, size_t size);
+int open_image_cipher(gcry_cipher_hd_t *hd, int aes);
+int set_block_counter(gcry_cipher_hd_t hd, const unsigned char *ivec,
+			unsigned long index);
 
 #define SUSPEND_KEY_FILE_PATH	"/etc/suspend.key"
-#define ENCRYPT_BUF_PAGES	256
 
 extern gcry_cipher_hd_t cipher_handle;
 extern struct key_data key_data;
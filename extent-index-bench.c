@@ -0,0 +1,178 @@
+/*
+ * extent-index-bench.c
+ *
+ * Replay sequences of swap offsets into an extent index and measure how long
+ * it takes and how many extents pages the result would fill.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "swsusp.h"
+#include "memalloc.h"
+#include "extent_index.h"
+
+#define NR_PAGES	(1 << 20)
+/* Index size in extents pages, as used for a batch of allocations by s2disk */
+#define INDEX_PAGES	8
+
+static loff_t *offsets;
+
+/* Sequential pages */
+static void fill_sequential(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		offsets[i] = (i + 1) * page_size;
+}
+
+/* Sequential pages in reverse order */
+static void fill_reverse(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		offsets[i] = (n - i) * page_size;
+}
+
+/* Runs of 16 pages with holes between them, later filled in */
+static void fill_holes(unsigned long n)
+{
+	unsigned long i, half = n / 2;
+
+	for (i = 0; i < n; i++) {
+		unsigned long k = i < half ? i : i - half;
+		unsigned long page = (k / 16) * 32 + k % 16;
+
+		offsets[i] = (page + 1 + (i < half ? 0 : 16)) * page_size;
+	}
+}
+
+/* Every page of a window of 8191 pages visited with a stride of 37 */
+static void fill_strided(unsigned long n)
+{
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		offsets[i] = (1 + (i / 8191) * 8191 + (i % 8191) * 37 % 8191) *
+				page_size;
+}
+
+/* Random permutation of the pages */
+static void fill_random(unsigned long n)
+{
+	unsigned long i;
+
+	fill_sequential(n);
+	srand(1);
+	for (i = n - 1; i > 0; i--) {
+		unsigned long j = ((unsigned long)rand() * RAND_MAX + rand()) %
+					(i + 1);
+		loff_t tmp = offsets[i];
+
+		offsets[i] = offsets[j];
+		offsets[j] = tmp;
+	}
+}
+
+/* Swap offsets in bytes, one per line, e.g. recorded on a real system */
+static unsigned long fill_file(const char *name, unsigned long n)
+{
+	unsigned long long offset;
+	unsigned long i = 0;
+	FILE *file;
+
+	file = fopen(name, "r");
+	if (!file) {
+		perror(name);
+		return 0;
+	}
+	while (i < n && fscanf(file, "%llu", &offset) == 1)
+		if (offset && !(offset % page_size))
+			offsets[i++] = offset;
+	fclose(file);
+	return i;
+}
+
+/**
+ *	replay - add @n offsets to @index, as alloc_swap() would
+ *
+ *	Whenever the index may have no room for another extent, its contents
+ *	are accounted for as saved and it is cleared.
+ */
+static void replay(const char *name, struct extent_index *index,
+			unsigned long n)
+{
+	const int max = page_size / sizeof(struct extent) - 1;
+	unsigned long i, extents = 0, pages = 0;
+	struct timeval begin, end;
+	double time;
+
+	extent_index_clear(index);
+	gettimeofday(&begin, NULL);
+	for (i = 0; i < n; i++) {
+		if (extent_index_full(index)) {
+			extents += index->nr_extents;
+			pages += (index->nr_extents + max - 1) / max;
+			extent_index_clear(index);
+		}
+		if (extent_index_add(index, offsets[i])) {
+			fprintf(stderr, "%s: offset %lld added twice\n", name,
+				(long long)offsets[i]);
+			return;
+		}
+	}
+	gettimeofday(&end, NULL);
+	extents += index->nr_extents;
+	pages += (index->nr_extents + max - 1) / max;
+	timersub(&end, &begin, &end);
+	time = end.tv_sec + end.tv_usec / 1000000.0;
+	printf("%-12s %9lu pages %9lu extents %7lu extents pages "
+		"%8.1lf ns/page\n", name, n, extents, pages,
+		n ? time * 1e9 / n : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct extent_index index;
+	unsigned long n = NR_PAGES;
+	int size, j;
+
+	get_page_and_buffer_sizes();
+	size = INDEX_PAGES * (page_size / sizeof(struct extent) - 1);
+	offsets = malloc(n * sizeof(loff_t));
+	if (!offsets || init_memalloc(extent_index_mem_size(size)) ||
+	    extent_index_init(&index, size)) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+
+	if (argc > 1) {
+		for (j = 1; j < argc; j++)
+			replay(argv[j], &index, fill_file(argv[j], n));
+		return 0;
+	}
+	fill_sequential(n);
+	replay("sequential", &index, n);
+	fill_reverse(n);
+	replay("reverse", &index, n);
+	fill_holes(n);
+	replay("holes", &index, n);
+	fill_strided(n);
+	replay("strided", &index, n);
+	fill_random(n);
+	replay("random", &index, n);
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * extent_index.c
+ *
+ * Index of swap extents used for tracking swap allocations, implemented as
+ * a skip list over a fixed array of nodes, and the compact encoding of
+ * extents used in the image map.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "swsusp.h"
+#include "memalloc.h"
+#include "extent_index.h"
+
+/**
+ *	extent_index_mem_size - memory needed by an index of @size extents
+ */
+size_t extent_index_mem_size(int size)
+{
+	return round_up_page_size((size + 1) * sizeof(struct extent_node));
+}
+
+/**
+ *	extent_index_init - allocate memory for an index and make it empty
+ *	@index:		Index to initialize.
+ *	@size:		Maximum number of extents to hold.
+ */
+int extent_index_init(struct extent_index *index, int size)
+{
+	index->nodes = getmem(extent_index_mem_size(size));
+	if (!index->nodes)
+		return -ENOMEM;
+	index->size = size;
+	index->seed = 1;
+	extent_index_clear(index);
+	return 0;
+}
+
+void extent_index_free(struct extent_index *index)
+{
+	if (index->nodes)
+		freemem(index->nodes);
+	index->nodes = NULL;
+}
+
+/**
+ *	extent_index_clear - remove all extents from @index
+ */
+void extent_index_clear(struct extent_index *index)
+{
+	memset(index->nodes, 0, sizeof(struct extent_node));
+	index->nr_extents = 0;
+	index->level = 1;
+	index->free = 0;
+	index->unused = 1;
+}
+
+/**
+ *	random_level - choose the number of levels of a new node
+ *
+ *	Every level is used by a quarter of the nodes of the level below.
+ */
+static int random_level(struct extent_index *index)
+{
+	unsigned int x = index->seed;
+	int level = 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	index->seed = x;
+	while (level < EXTENT_INDEX_LEVELS && !(x & 3)) {
+		level++;
+		x >>= 2;
+	}
+	return level;
+}
+
+static int get_node(struct extent_index *index)
+{
+	int i = index->free;
+
+	if (i)
+		index->free = index->nodes[i].next[0];
+	else if (index->unused <= index->size)
+		i = index->unused++;
+	return i;
+}
+
+static void put_node(struct extent_index *index, int i)
+{
+	index->nodes[i].next[0] = index->free;
+	index->free = i;
+}
+
+/**
+ *	extent_index_add - add one swap page to an index
+ *	@index:		Index to add the page to.
+ *	@offset:	Swap offset of the page.
+ *
+ *	If the page is adjacent to an extent in @index, that extent is
+ *	extended, and merged with its neighbour if the page fills the gap
+ *	between them.  Otherwise, a new extent is created, which fails with
+ *	-ENOSPC if @index is full.
+ */
+int extent_index_add(struct extent_index *index, loff_t offset)
+{
+	struct extent_node *nodes = index->nodes;
+	int update[EXTENT_INDEX_LEVELS];
+	int i = 0, j, level, l;
+
+	/* Find the last extent starting at or below @offset at every level */
+	for (l = index->level - 1; l >= 0; l--) {
+		while ((j = nodes[i].next[l]) && nodes[j].ext.start <= offset)
+			i = j;
+		update[l] = i;
+	}
+	j = nodes[i].next[0];
+	if (i && offset < nodes[i].ext.end)
+		return -EEXIST;
+
+	if (i && offset == nodes[i].ext.end) {
+		nodes[i].ext.end += page_size;
+		if (j && nodes[j].ext.start == nodes[i].ext.end) {
+			/* The gap is filled, merge the extents */
+			nodes[i].ext.end = nodes[j].ext.end;
+			for (l = 0; l < index->level; l++) {
+				if (nodes[update[l]].next[l] != j)
+					break;
+				nodes[update[l]].next[l] = nodes[j].next[l];
+			}
+			put_node(index, j);
+			index->nr_extents--;
+		}
+		return 0;
+	}
+	if (j && offset + page_size == nodes[j].ext.start) {
+		nodes[j].ext.start = offset;
+		return 0;
+	}
+
+	j = get_node(index);
+	if (!j)
+		return -ENOSPC;
+	level = random_level(index);
+	for (l = index->level; l < level; l++)
+		update[l] = 0;
+	if (level > index->level)
+		index->level = level;
+	nodes[j].ext.start = offset;
+	nodes[j].ext.end = offset + page_size;
+	for (l = 0; l < level; l++) {
+		nodes[j].next[l] = nodes[update[l]].next[l];
+		nodes[update[l]].next[l] = j;
+	}
+	index->nr_extents++;
+	return 0;
+}
+
+/*
+ * In an extent map every extent is stored as two numbers of pages: the
+ * distance between its start and the end of the previous extent (zigzag
+ * encoded, as it may be negative) and its length minus one.  Both are stored
+ * as varints holding 7 bits per byte, least significant bits first, with the
+ * high bit set in every byte but the last one.
+ */
+
+/**
+ *	put_varint - store a number as a varint
+ *
+ *	Returns the number of bytes stored (at most VARINT_MAX).
+ */
+size_t put_varint(unsigned char *buf, uint64_t val)
+{
+	size_t n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[n++] = val;
+	return n;
+}
+
+/**
+ *	get_varint - read a varint at position @pos of @buf and advance @pos
+ */
+int get_varint(const unsigned char *buf, size_t size, size_t *pos,
+			uint64_t *val)
+{
+	unsigned int shift;
+
+	*val = 0;
+	for (shift = 0; *pos < size && shift < 64; shift += 7) {
+		unsigned char byte = buf[(*pos)++];
+
+		*val |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/**
+ *	extent_map_put - append an extent to an extent map
+ *	@buf:		Where to store the extent (at least EXTENT_MAP_MAX
+ *			bytes).
+ *	@prev_end:	End of the previous extent in the map (0 initially),
+ *			updated.
+ *	@ext:		Extent to store.
+ *
+ *	Returns the number of bytes stored.
+ */
+size_t extent_map_put(unsigned char *buf, loff_t *prev_end, struct extent *ext)
+{
+	int64_t delta = (ext->start - *prev_end) / (loff_t)page_size;
+	size_t n;
+
+	n = put_varint(buf, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	n += put_varint(buf + n,
+			(ext->end - ext->start) / page_size - 1);
+	*prev_end = ext->end;
+	return n;
+}
+
+/**
+ *	extent_map_get - read the next extent from an extent map
+ *	@buf:		The map.
+ *	@size:		Size of the map.
+ *	@pos:		Position of the extent in the map, updated.
+ *	@prev_end:	End of the previous extent in the map (0 initially),
+ *			updated.
+ *	@ext:		Where to store the extent.
+ *
+ *	Returns -ENODATA at the end of the map and -EINVAL if the map is
+ *	corrupted.
+ */
+int extent_map_get(const unsigned char *buf, size_t size, size_t *pos,
+			loff_t *prev_end, struct extent *ext)
+{
+	uint64_t delta, len;
+
+	if (*pos >= size)
+		return -ENODATA;
+	if (get_varint(buf, size, pos, &delta) ||
+	    get_varint(buf, size, pos, &len))
+		return -EINVAL;
+	ext->start = *prev_end +
+		(loff_t)((delta >> 1) ^ -(delta & 1)) * page_size;
+	ext->end = ext->start + (loff_t)(len + 1) * page_size;
+	if (ext->start <= 0 || ext->end <= ext->start)
+		return -EINVAL;
+	*prev_end = ext->end;
+	return 0;
+}
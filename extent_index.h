@@ -0,0 +1,103 @@
+/*
+ * extent_index.h
+ *
+ * Definitions of the index of swap extents used for tracking swap
+ * allocations and of the compact encoding of extents in the image map.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include <sys/types.h>
+
+/* Maximum number of levels of the skip list */
+#define EXTENT_INDEX_LEVELS	8
+
+/* Maximum number of bytes taken by a varint */
+#define VARINT_MAX	10
+
+/* Maximum number of bytes taken by one extent in an extent map */
+#define EXTENT_MAP_MAX	(2 * VARINT_MAX)
+
+/**
+ *	struct extent_node - element of an extent index
+ *	@ext:	Area of swap covered by the node.
+ *	@next:	Indices of the next nodes at every level of the skip list, or 0
+ *		if there are none.
+ */
+struct extent_node {
+	struct extent ext;
+	int next[EXTENT_INDEX_LEVELS];
+};
+
+/**
+ *	struct extent_index - sorted set of disjoint swap extents
+ *	@nodes:		Array of @size + 1 nodes.  Node 0 is the head of the
+ *			skip list and doesn't represent any extent.
+ *	@size:		Maximum number of extents in the index.
+ *	@nr_extents:	Number of extents in the index.
+ *	@level:		Number of skip list levels actually used.
+ *	@free:		First node on the list of released nodes, linked by
+ *			their next[0] fields.
+ *	@unused:	First node that has never been used.
+ *	@seed:		State of the generator of node levels.
+ *
+ *	Adding a page to the index, which may extend an extent or merge two
+ *	of them, takes O(log n) time on average, as well as finding the
+ *	neighbours of an offset does.  The nodes come from a fixed array, so
+ *	the index doesn't allocate memory after it has been initialized.
+ */
+struct extent_index {
+	struct extent_node *nodes;
+	int size;
+	int nr_extents;
+	int level;
+	int free;
+	int unused;
+	unsigned int seed;
+};
+
+size_t extent_index_mem_size(int size);
+int extent_index_init(struct extent_index *index, int size);
+void extent_index_free(struct extent_index *index);
+void extent_index_clear(struct extent_index *index);
+int extent_index_add(struct extent_index *index, loff_t offset);
+size_t put_varint(unsigned char *buf, uint64_t val);
+int get_varint(const unsigned char *buf, size_t size, size_t *pos,
+			uint64_t *val);
+size_t extent_map_put(unsigned char *buf, loff_t *prev_end, struct extent *ext);
+int extent_map_get(const unsigned char *buf, size_t size, size_t *pos,
+			loff_t *prev_end, struct extent *ext);
+
+/**
+ *	extent_index_full - check if adding a page to @index may fail
+ */
+static inline int extent_index_full(struct extent_index *index)
+{
+	return !index->free && index->unused > index->size;
+}
+
+/**
+ *	extent_index_first - the node of the extent with the lowest offset
+ *
+ *	Returns 0 if @index is empty.
+ */
+static inline int extent_index_first(struct extent_index *index)
+{
+	return index->nodes->next[0];
+}
+
+/**
+ *	extent_index_next - the node following node @i in the offset order
+ *
+ *	Returns 0 if node @i is the last one.
+ */
+static inline int extent_index_next(struct extent_index *index, int i)
+{
+	return index->nodes[i].next[0];
+}
+
+static inline struct extent *extent_index_get(struct extent_index *index, int i)
+{
+	return &index->nodes[i].ext;
+}
@@ -23,13 +23,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#ifdef CONFIG_COMPRESS
-#include <lzo/lzo1x.h>
-#endif
+#include <endian.h>
 
 #include "swsusp.h"
 #include "memalloc.h"
 #include "md5.h"
+#include "checksum.h"
+#include "classify.h"
+#include "pipeline.h"
+#include "swap_io.h"
+#include "extent_index.h"
 #include "splash.h"
 
 char *my_name;
@@ -38,14 +41,30 @@ static char verify_checksum;
 #ifdef CONFIG_COMPRESS
 unsigned int compress_buf_size;
 static char do_decompress;
+static const struct compressor *decompressor;
+static atomic_ulong nr_blocks, nr_raw_blocks;
+static atomic_ulong nr_level_blocks[BUF_BLOCK_LEVELS];
+static char do_unpack, do_dedup;
+static unsigned long nr_zero_pages, nr_sparse_pages, nr_dup_pages;
+static const struct checksum_method *block_checksum;
 #else
 #define do_decompress 0
+#define do_unpack 0
+#define do_dedup 0
 #endif
 #ifdef CONFIG_ENCRYPT
 static char do_decrypt;
+static char aes_ctr;
+/* Set if the "decode" threads have to decrypt the data */
+static char decode_decrypt;
 static char password[PASSBUF_SIZE];
 #else
 #define do_decrypt 0
+#define decode_decrypt 0
+#endif
+#ifdef CONFIG_THREADS
+unsigned int nr_read_buffers = 1;
+int decompress_threads;
 #endif
 
 /**
@@ -76,7 +95,26 @@ static int read_page(int fd, void *buf, loff_t offset)
  * @extents:	Array of extents used for trackig swap allocations.  It is
  *		page_size bytes large and holds at most
  *		(page_size / sizeof(struct extent) - 1) extents.  The last slot
- *		must be all zeros and is the end marker.
+ *		must be all zeros and is the end marker.  If @map is used, it
+ *		only holds the extent taken from the map most recently.
+ *
+ * @map:		Extent map of the image, if it has one, loaded as a whole
+ *			before the image data.  Otherwise the extents pages are
+ *			loaded one by one as they are needed.
+ *
+ * @map_size:		Number of bytes in @map.
+ *
+ * @map_pos:		Position of the next extent in @map.
+ *
+ * @map_end:		End of the last extent taken from @map.
+ *
+ * @index:		Block index of the image, if it has one.  It tells how
+ *			many swap pages each block takes, so blocks can be read
+ *			with one request each.
+ *
+ * @index_size:		Number of bytes in @index.
+ *
+ * @index_pos:		Position of the entry of the next block in @index.
  *
  * @cur_extent:		The extent currently used as the source of swap pages.
  *
@@ -84,32 +122,45 @@ static int read_page(int fd, void *buf, loff_t offset)
  *
  * @total_size:		The amount of data to read.
  *
- * @buffer:		Buffer used for storing image data pages.
- *
- * @read_buffer:	If compression is used, the compressed contents of
- *			@buffer are stored here.  Otherwise, it is equal to
- *			@buffer.
+ * @pipeline:		Pipeline loading blocks of image data (see
+ *			setup_pipeline()).
  *
  * @fd:			File handle associated with the swap.
  *
  * @ctx:		Used for checksum computing, if so configured.
  *
- * @lzo_work_buffer:	Work buffer used for decompression.
+ * @decompress_work_buffer:	Work buffers used for decompression (one per
+ *				"decode" thread).
+ *
+ * @decompress_work_size:	Size of the work buffer of one thread.
  *
- * @decrypt_buffer:	Buffer for storing encrypted pages (page_size bytes).
+ * @io:			Batch of image data pages to be read from the swap.
+ *
+ * @page_buffer:	Buffer for expanding page records (page_size bytes).
+ *
+ * @page_cache:		Recently loaded pages referred to by page records.
  */
 struct swap_reader {
 	struct extent *extents;
 	struct extent *cur_extent;
 	loff_t cur_offset;
 	loff_t next_extents;
+	unsigned char *map;
+	size_t map_size;
+	size_t map_pos;
+	loff_t map_end;
+	unsigned char *index;
+	size_t index_size;
+	size_t index_pos;
 	loff_t total_size;
-	void *buffer;
-	void *read_buffer;
+	struct pipeline pipeline;
 	int fd;
 	struct md5_ctx ctx;
-	void *lzo_work_buffer;
-	char *decrypt_buffer;
+	void *decompress_work_buffer;
+	size_t decompress_work_size;
+	struct swap_io io;
+	void *page_buffer;
+	struct page_cache page_cache;
 };
 
 /**
@@ -141,59 +192,219 @@ static int load_extents_page(struct swap_reader *handle)
 	return 0;
 }
 
+/**
+ *	load_map_extent - take the next extent from the extent map
+ *	handle:	Structure holding the map.
+ *
+ *	Store the extent in @handle->extents, followed by the end marker, and
+ *	initialize @handle->cur_extent and @handle->cur_offset as appropriate.
+ */
+static int load_map_extent(struct swap_reader *handle)
+{
+	int error;
+
+	error = extent_map_get(handle->map, handle->map_size, &handle->map_pos,
+				&handle->map_end, handle->extents);
+	if (error)
+		return error;
+	handle->cur_extent = handle->extents;
+	handle->cur_offset = handle->cur_extent->start;
+	if (posix_fadvise(handle->fd, handle->cur_offset,
+			handle->cur_extent->end - handle->cur_offset,
+			POSIX_FADV_NOREUSE))
+		perror("posix_fadvise");
+	return 0;
+}
+
+/**
+ *	load_metadata - load the extent map or the block index of the image
+ *	handle:	Structure holding the swap reader.
+ *	buf_p:	Where to store the address of the data loaded.
+ *	size:	Number of bytes to load.
+ *	pages:	Swap pages holding the data.
+ *	max:	Maximum number of pages.
+ *
+ *	The pages are usually adjacent to one another in the swap, so reading
+ *	them takes one request.
+ */
+static int load_metadata(struct swap_reader *handle, unsigned char **buf_p,
+			size_t size, loff_t *pages, unsigned int max)
+{
+	unsigned int n, j;
+	int error;
+
+	n = (size + page_size - 1) / page_size;
+	if (!n || n > max)
+		return -EINVAL;
+	*buf_p = getmem(n * page_size);
+	if (!*buf_p)
+		return -ENOMEM;
+	for (j = 0; j < n; j++) {
+		error = swap_io_add(&handle->io, *buf_p + j * page_size,
+					pages[j]);
+		if (error)
+			return error;
+	}
+	return swap_io_flush(&handle->io);
+}
+
 /**
  *	free_swap_reader - free memory allocated for loading the image
  *	@handle:	Structure containing pointers to memory buffers to free.
  */
 static void free_swap_reader(struct swap_reader *handle)
 {
-	if (do_decompress) {
-		freemem(handle->lzo_work_buffer);
-		freemem(handle->read_buffer);
-	}
-	if (do_decrypt)
-		 freemem(handle->decrypt_buffer);
-	freemem(handle->buffer);
+	if (do_decompress && handle->decompress_work_buffer)
+		freemem(handle->decompress_work_buffer);
+	if (do_dedup && handle->page_cache.pages)
+		free_page_cache(&handle->page_cache);
+	if (do_unpack)
+		freemem(handle->page_buffer);
+	pipeline_free(&handle->pipeline);
+	if (handle->index)
+		freemem(handle->index);
+	if (handle->map)
+		freemem(handle->map);
 	freemem(handle->extents);
 }
 
+#ifdef CONFIG_COMPRESS
+/**
+ *	block_buffer_size - size of a block of the pipeline for compressed data
+ *	@bound:	Worst-case size of buffer_size bytes of data once compressed.
+ *
+ *	The block has to hold the compressed data, the block header and the
+ *	block checksum.
+ */
+unsigned int block_buffer_size(size_t bound)
+{
+	return buffer_size + round_up_page_size(bound - buffer_size +
+			BUF_BLOCK_HEADER_SIZE + BUF_BLOCK_CHECKSUM_SIZE);
+}
+#endif
+
+/**
+ *	swap_reader_mem_size - memory needed for loading or verifying the image
+ *	@compressed:	The image is compressed.
+ *	@unpack:	The image data contain page records.
+ *	@dedup:		The page records may refer to pages loaded before.
+ *	@work_size:	Size of the decompression work memory of one thread.
+ *
+ *	This goes through the allocations made by init_swap_reader(), so it
+ *	has to be kept in sync with that function.
+ */
+size_t swap_reader_mem_size(int compressed, int unpack, int dedup,
+				size_t work_size)
+{
+	size_t size;
+
+	size = page_size;
+	size += pipeline_mem_size(nr_read_buffers,
+			compressed ? compress_buf_size : buffer_size,
+			compressed);
+	if (unpack)
+		size += page_size;
+	if (dedup)
+		size += page_cache_size(0);
+	if (compressed)
+		size += (decompress_threads > 0 ? decompress_threads : 1) *
+				round_up_page_size(work_size);
+	size += IMAGE_MAP_PAGES * page_size;
+	if (compressed)
+		size += IMAGE_INDEX_PAGES * page_size;
+	return size;
+}
+
 /**
  *	init_swap_reader - initialize the structure used for loading the image
  *	@handle:	Structure to initialize.
  *	@fd:		File descriptor associated with the swap.
- *	@start:		Swap location (offset) of the first image page.
- *	@image_size:	Total size of the image data.
+ *	@header:	Image header pointing to the extents.
  *
- *	Initialize buffers and related fields of @handle and load the first
- *	array of extents.
+ *	Initialize buffers and related fields of @handle and load the extent
+ *	map, if the image has one, or the first array of extents.
  */
-static int init_swap_reader(struct swap_reader *handle, int fd, loff_t start,
-							loff_t image_size)
+static int init_swap_reader(struct swap_reader *handle, int fd,
+				struct image_header_info *header)
 {
 	int error;
 
-	if (!start)
+	if (!header->map_start)
 		return -EINVAL;
 
+	/*
+	 * @handle may be left over from loading the image before, so make
+	 * sure free_swap_reader() doesn't see any stale pointers in it.
+	 */
+	handle->map = NULL;
+	handle->index = NULL;
+	handle->page_buffer = NULL;
+	handle->page_cache.pages = NULL;
+	handle->decompress_work_buffer = NULL;
+
 	handle->fd = fd;
-	handle->total_size = image_size;
+	swap_io_init(&handle->io, fd, 0);
+	handle->total_size = header->image_data_size;
 
 	handle->extents = getmem(page_size);
 
-	handle->buffer = getmem(buffer_size);
-	handle->read_buffer = handle->buffer;
+	error = pipeline_init(&handle->pipeline, nr_read_buffers,
+			do_decompress ? compress_buf_size : buffer_size,
+			do_decompress);
+	if (error) {
+		freemem(handle->extents);
+		return error;
+	}
 
-	if (do_decrypt)
-		handle->decrypt_buffer = getmem(page_size);
+	if (do_unpack)
+		handle->page_buffer = getmem(page_size);
 
+	if (do_dedup) {
+		error = init_page_cache(&handle->page_cache, 0);
+		if (error) {
+			free_swap_reader(handle);
+			return error;
+		}
+	}
+
+#ifdef CONFIG_COMPRESS
 	if (do_decompress) {
-		handle->read_buffer = getmem(compress_buf_size);
-		handle->lzo_work_buffer = getmem(LZO1X_1_MEM_COMPRESS);
+		handle->decompress_work_size = round_up_page_size(
+				decompressor->decompress_work_size());
+		handle->decompress_work_buffer =
+			handle->decompress_work_size > 0 ?
+				getmem((decompress_threads > 0 ?
+					decompress_threads : 1) *
+					handle->decompress_work_size) : NULL;
+		if (handle->decompress_work_size > 0 &&
+		    !handle->decompress_work_buffer) {
+			free_swap_reader(handle);
+			return -ENOMEM;
+		}
 	}
+#endif
 
 	/* Read the table of extents */
-	handle->next_extents = start;
-	error = load_extents_page(handle);
+	if (header->flags & IMAGE_MAP) {
+		memset(handle->extents, 0, page_size);
+		handle->map_size = header->map_size;
+		handle->map_pos = 0;
+		handle->map_end = 0;
+		error = load_metadata(handle, &handle->map, handle->map_size,
+					header->map_pages, IMAGE_MAP_PAGES);
+		if (!error)
+			error = load_map_extent(handle);
+	} else {
+		handle->next_extents = header->map_start;
+		error = load_extents_page(handle);
+	}
+	if (!error && do_decompress && (header->flags & IMAGE_BLOCK_INDEX)) {
+		handle->index_size = header->index_size;
+		handle->index_pos = 0;
+		error = load_metadata(handle, &handle->index,
+					handle->index_size,
+					header->index_pages, IMAGE_INDEX_PAGES);
+	}
 	if (error) {
 		free_swap_reader(handle);
 		return error;
@@ -225,100 +436,326 @@ static void find_next_image_page(struct swap_reader *handle)
 			perror("posix_fadvise");
 		return;
 	}
-	/* No more extents.  Load the next extents page. */
-	error = load_extents_page(handle);
+	/* No more extents.  Load the next ones. */
+	if (handle->map)
+		error = load_map_extent(handle);
+	else
+		error = load_extents_page(handle);
 	if (error)
 		handle->cur_offset = 0;
 }
 
 /**
- *	load_and_decrypt_page - load a page of data from swap and decrypt it,
+ *	load_and_decrypt_pages - load pages of data from swap and decrypt them,
  *			if necessary.
+ *	@handle:	Structure containing image information.
+ *	@dst:		Where to put the data.
+ *	@nr_pages:	Number of pages to load.
+ *
+ *	Runs of pages that are adjacent in the swap are read with one system
+ *	call each.
  */
-static int load_and_decrypt_page(struct swap_reader *handle, void *dst)
+static int load_and_decrypt_pages(struct swap_reader *handle, void *dst,
+					unsigned int nr_pages)
 {
+	char *buf = dst;
+	unsigned int n;
 	int error;
-	void *buf = dst;
 
-	if (!handle->cur_offset)
-		return -EINVAL;
+	for (n = 0; n < nr_pages; n++) {
+		error = swap_io_add(&handle->io, buf, handle->cur_offset);
+		if (error)
+			return error;
+		handle->total_size -= page_size;
+		find_next_image_page(handle);
+		buf += page_size;
+	}
+	error = swap_io_flush(&handle->io);
 
-	if (do_decrypt)
-		buf = handle->decrypt_buffer;
+#ifdef CONFIG_ENCRYPT
+	if (!error && do_decrypt && !decode_decrypt)
+		error = gcry_cipher_decrypt(cipher_handle, dst,
+					nr_pages * page_size, NULL, 0);
+#endif
+	return error;
+}
 
-	error = read_page(handle->fd, buf, handle->cur_offset);
+/*
+ * The image data are loaded with the help of a pipeline (see pipeline.h).  Its
+ * stages are:
+ *
+ * "read"	- load (and decrypt, if necessary) a block of data from the
+ *		  swap,
+ * "decode"	- verify the block checksum, if any, and decompress the block,
+ * "checksum"	- update the MD5 checksum of the image,
+ *
+ * after which load_image() receives the block and passes the image data pages
+ * in it to the kernel.
+ *
+ * If there are more than one read buffers, the "read" and "decode" stages are
+ * run by threads of their own, so that reading from the swap, decompression
+ * and writing to the kernel can overlap.  The "checksum" stage is then run by
+ * the "decode" thread (or by the "read" thread if the image is not
+ * compressed), which gets the blocks in order.
+ *
+ * With more than one "decode" thread (decompress_threads) several blocks are
+ * decompressed at a time and may complete out of order, so the "checksum"
+ * stage gets a thread of its own.  pipeline_receive() still returns the blocks
+ * in the image order, which is what the snapshot device needs, and the number
+ * of blocks in flight is limited by the number of read buffers.  If the image
+ * is encrypted with AES-CTR and has a block index, the "read" stage doesn't
+ * need to look into the blocks, so they are decrypted by the "decode" threads
+ * as well.
+ */
 
+#ifdef CONFIG_COMPRESS
+/**
+ *	struct decode_worker - resources of a "decode" thread (or of the
+ *			thread running the "decode" stage, if there are no
+ *			"decode" threads)
+ */
+struct decode_worker {
+	void *work_buffer;
 #ifdef CONFIG_ENCRYPT
-	if (!error && do_decrypt)
-		error = gcry_cipher_decrypt(cipher_handle, dst, page_size,
-							buf, page_size);
+	gcry_cipher_hd_t cipher;
 #endif
+};
 
-	if (!error) {
-		handle->total_size -= page_size;
-		find_next_image_page(handle);
-	}
+static struct decode_worker decode_workers[DECOMPRESS_THREADS_MAX];
+
+#ifdef CONFIG_ENCRYPT
+static int open_decode_cipher(struct decode_worker *dw)
+{
+	int error;
+
+	error = open_image_cipher(&dw->cipher, 1);
+	if (error)
+		return error;
+	error = gcry_cipher_setkey(dw->cipher, key_data.key, KEY_SIZE);
+	if (error)
+		gcry_cipher_close(dw->cipher);
 	return error;
 }
+#endif
+
+/**
+ *	block_data_size - number of bytes in a compressed block, including the
+ *			header and the checksum
+ */
+static size_t block_data_size(struct buf_block *b)
+{
+	size_t size = (size_t)b->size + BUF_BLOCK_HEADER_SIZE;
+
+	if (block_checksum)
+		size += BUF_BLOCK_CHECKSUM_SIZE;
+	return size;
+}
+#endif
 
 /**
- *	load_buffer - load (and decrypt, if necessary) a block od data from the
- *			swap, decompress it if necessary and store it in the
- *			image data buffer.
+ *	read_block - load (and decrypt, if necessary) a block of data from the
+ *			swap
  */
-static ssize_t load_buffer(struct swap_reader *handle)
+static int read_block(struct pipeline_block *block, int worker, void *data)
 {
-	void *dst;
+	struct swap_reader *handle = data;
 	ssize_t size;
 	int error;
 
+	(void)worker;
+	if (handle->total_size <= 0)
+		return PIPELINE_END;
+
+#ifdef CONFIG_ENCRYPT
+	if (do_decrypt && aes_ctr && !decode_decrypt) {
+		error = set_block_counter(cipher_handle, key_data.ivec,
+						block->index);
+		if (error)
+			return error;
+	}
+#endif
+
 #ifdef CONFIG_COMPRESS
 	if (do_decompress) {
-		struct buf_block *block = handle->read_buffer;
-		lzo_uint cnt;
-
+		struct buf_block *b = block->data;
+		size_t block_size;
+		unsigned int n = 1;
+
+		if (handle->index) {
+			uint64_t nr_pages, size;
+
+			/* The index tells how many pages to read */
+			if (get_varint(handle->index, handle->index_size,
+					&handle->index_pos, &nr_pages) ||
+			    get_varint(handle->index, handle->index_size,
+					&handle->index_pos, &size) ||
+			    (size + 1) * page_size >
+					round_up_page_size(compress_buf_size))
+				return -EINVAL;
+			block->nr_pages = nr_pages;
+			n = size + 1;
+		}
 		/* Read the block size from the first block page. */
-		error = load_and_decrypt_page(handle, block);
+		error = load_and_decrypt_pages(handle, b, n);
 		if (error)
+			return error;
+		if (decode_decrypt) {
+			/* decode_block() will check the size after decryption */
+			block->size = n * page_size;
 			return 0;
-		size = page_size;
-		dst = block;
-		dst += page_size;
+		}
+		block_size = block_data_size(b);
+		if (block_size > compress_buf_size)
+			return -EINVAL;
 		/* Load the rest of the block pages */
-		while (size < block->size + sizeof(size_t)) {
-			error = load_and_decrypt_page(handle, dst);
+		if (round_up_page_size(block_size) != n * page_size) {
+			if (handle->index)
+				return -EINVAL;
+			error = load_and_decrypt_pages(handle,
+				(char *)b + page_size,
+				round_up_page_size(block_size) / page_size - 1);
 			if (error)
-				return 0;
-			size += page_size;
-			dst += page_size;
+				return error;
 		}
-		/* Decompress block */
-		error = lzo1x_decompress((lzo_bytep)block->data, block->size,
-						handle->buffer, &cnt,
-						handle->lzo_work_buffer);
-		if (error)
-			return 0;
-		size = cnt;
-		goto Checksum;
+		block->size = block_size;
+		return 0;
 	}
 #endif
-	dst = handle->buffer;
-	size = 0;
-	while (size < buffer_size && handle->total_size > 0) {
-		error = load_and_decrypt_page(handle, dst);
+	size = round_up_page_size(handle->total_size < buffer_size ?
+					handle->total_size : buffer_size);
+	error = load_and_decrypt_pages(handle, block->data, size / page_size);
+	if (error)
+		return error;
+	block->size = size;
+	return 0;
+}
+
+#ifdef CONFIG_COMPRESS
+/**
+ *	decode_block - verify the checksum of a block of data and decompress it
+ */
+static int decode_block(struct pipeline_block *block, int worker, void *data)
+{
+	struct swap_reader *handle = data;
+	struct decode_worker *dw = decode_workers + worker;
+	struct buf_block *b = block->data;
+	ssize_t size;
+	uint64_t sum;
+
+#ifdef CONFIG_ENCRYPT
+	if (decode_decrypt) {
+		int error;
+
+		error = set_block_counter(dw->cipher, key_data.ivec,
+						block->index);
+		if (!error)
+			error = gcry_cipher_decrypt(dw->cipher, b, block->size,
+							NULL, 0);
 		if (error)
-			return 0;
-		size += page_size;
-		dst += page_size;
+			return error;
+		if (round_up_page_size(block_data_size(b)) !=
+						(size_t)block->size)
+			return -EINVAL;
+		block->size = block_data_size(b);
 	}
+#endif
+	nr_blocks++;
+	if (block_checksum) {
+		memcpy(&sum, b->data + b->size, BUF_BLOCK_CHECKSUM_SIZE);
+		if (sum != block_checksum->compute(b,
+				BUF_BLOCK_HEADER_SIZE + b->size)) {
+			printf("\nChecksum mismatch in image data block %lu\n",
+				block->index + 1);
+			return -EIO;
+		}
+	}
+	if (b->flags & BUF_BLOCK_RAW) {
+		/* The block has been stored without compression */
+		if (b->size > buffer_size)
+			return -EINVAL;
+		memcpy(block->aux, b->data, b->size);
+		size = b->size;
+		nr_raw_blocks++;
+	} else {
+		nr_level_blocks[BUF_BLOCK_LEVEL(b->flags)]++;
+		size = decompressor->decompress(b->data, b->size,
+					block->aux, buffer_size,
+					dw->work_buffer,
+					handle->decompress_work_size);
+		if (size <= 0)
+			return -EIO;
+	}
+	pipeline_swap_buffers(block);
+	block->size = size;
+	return 0;
+}
+#endif
+
+static int checksum_block(struct pipeline_block *block, int worker, void *data)
+{
+	struct swap_reader *handle = data;
 
+	(void)worker;
+	md5_process_bytes(block->data, block->size, &handle->ctx);
+	return 0;
+}
+
+/**
+ *	setup_pipeline - add the stages to the pipeline and start it
+ */
+static void setup_pipeline(struct swap_reader *handle)
+{
+	struct pipeline *p = &handle->pipeline;
+	int workers = nr_read_buffers > 1 ? 1 : 0;
+	int decoders = workers && decompress_threads > 1 ?
+				decompress_threads : workers;
+#ifdef CONFIG_COMPRESS
+	int j;
+
+	if (do_decompress)
+		for (j = 0; j < (decoders > 0 ? decoders : 1); j++)
+			decode_workers[j].work_buffer =
+				(char *)handle->decompress_work_buffer +
+					j * handle->decompress_work_size;
+#ifdef CONFIG_ENCRYPT
+	decode_decrypt = do_decrypt && aes_ctr && handle->index &&
+				decoders > 1;
+	for (j = 0; decode_decrypt && j < decoders; j++)
+		if (open_decode_cipher(decode_workers + j)) {
+			fprintf(stderr, "%s: Failed to set up decryption in "
+				"the decode threads\n", my_name);
+			while (--j >= 0)
+				gcry_cipher_close(decode_workers[j].cipher);
+			decode_decrypt = 0;
+		}
+#endif
+#endif
+
+	pipeline_add_stage(p, "read", read_block, handle, workers);
 #ifdef CONFIG_COMPRESS
- Checksum:
+	if (do_decompress)
+		pipeline_add_stage(p, "decode", decode_block, handle, decoders);
 #endif
+	/* The "decode" threads may complete the blocks out of order */
 	if (verify_checksum)
-		md5_process_block(handle->buffer, size, &handle->ctx);
+		pipeline_add_stage(p, "checksum", checksum_block, handle,
+					do_decompress && decoders > 1 ? 1 : 0);
+	/* If the threads cannot be started, everything is done inline */
+	pipeline_start(p, 1, 1);
+}
 
-	return size;
+static void stop_pipeline(struct swap_reader *handle)
+{
+#if defined(CONFIG_COMPRESS) && defined(CONFIG_ENCRYPT)
+	int j;
+#endif
+
+	pipeline_stop(&handle->pipeline);
+#if defined(CONFIG_COMPRESS) && defined(CONFIG_ENCRYPT)
+	for (j = 0; decode_decrypt && j < decompress_threads; j++)
+		gcry_cipher_close(decode_workers[j].cipher);
+	decode_decrypt = 0;
+#endif
 }
 
 /**
@@ -330,10 +767,11 @@ static ssize_t load_buffer(struct swap_reader *handle)
 static int load_image(struct swap_reader *handle, int dev,
 					  unsigned int nr_pages, int verify_only)
 {
+	struct pipeline_block *block = NULL;
 	unsigned int m, n;
 	ssize_t buf_size;
 	ssize_t ret;
-	void *buf = 0;
+	void *buf = 0, *data;
 	int error = 0;
 	char message[SPLASH_GENERIC_MESSAGE_SIZE];
 
@@ -341,6 +779,8 @@ static int load_image(struct swap_reader *handle, int dev,
 	splash.set_caption(message);
 	printf("%s	 ", message);
 
+	setup_pipeline(handle);
+
 	m = nr_pages / 100;
 	if (!m)
 		m = 1;
@@ -348,23 +788,58 @@ static int load_image(struct swap_reader *handle, int dev,
 	buf_size = 0;
 	do {
 		if (buf_size <= 0) {
-			buf_size = load_buffer(handle);
-			if (buf_size <= 0) {
+			if (block)
+				pipeline_release(&handle->pipeline, block);
+			block = pipeline_receive(&handle->pipeline);
+			if (!block) {
 				printf("\n");
-				return -EIO;
+				error = -EIO;
+				goto Exit;
 			}
-			buf = handle->buffer;
+			buf = block->data;
+			buf_size = block->size;
 		}
-		ret = verify_only ? page_size : write(dev, buf, page_size);
+		if (do_unpack) {
+			struct page_cache *cache;
+			ssize_t size;
+
+			cache = do_dedup ? &handle->page_cache : NULL;
+			size = unpack_page(buf, buf_size, handle->page_buffer,
+						cache, &data);
+			if (size < 0) {
+				printf("\nInvalid page record\n");
+				error = -EIO;
+				goto Exit;
+			}
+#ifdef CONFIG_COMPRESS
+			switch (((struct page_record *)buf)->type) {
+			case PAGE_ZERO:
+				nr_zero_pages++;
+				break;
+			case PAGE_SPARSE:
+				nr_sparse_pages++;
+				break;
+			case PAGE_DUP:
+				nr_dup_pages++;
+				break;
+			}
+#endif
+			buf += size;
+			buf_size -= size;
+		} else {
+			data = buf;
+			buf += page_size;
+			buf_size -= page_size;
+		}
+		ret = verify_only ? page_size : write(dev, data, page_size);
 		if (ret < page_size) {
 			if (ret < 0)
 				perror("\nError while writing an image page");
 			else
 				printf("\n");
-			return -EIO;
+			error = -EIO;
+			goto Exit;
 		}
-		buf += page_size;
-		buf_size -= page_size;
 
 		if (!(n % m)) {
 			printf("\b\b\b\b%3d%%", n / m);
@@ -373,8 +848,12 @@ static int load_image(struct swap_reader *handle, int dev,
 		}
 		n++;
 	} while (n < nr_pages);
-	if (!error)
-		printf(" done\n");
+	printf(" done\n");
+
+ Exit:
+	if (block)
+		pipeline_release(&handle->pipeline, block);
+	stop_pipeline(handle);
 	return error;
 }
 
@@ -586,21 +1065,77 @@ static int restore_key(struct image_header_info *header)
 			ivec[j] ^= header->salt[j];
 	}
 	if (!error)
-		error = gcry_cipher_open(&cipher_handle,
-					IMAGE_CIPHER, GCRY_CIPHER_MODE_CFB,
-					GCRY_CIPHER_SECURE);
+		error = open_image_cipher(&cipher_handle, aes_ctr);
 	if (!error) {
 		error = gcry_cipher_setkey(cipher_handle, key, KEY_SIZE);
-		if (!error)
+		if (!error && !aes_ctr)
 			error = gcry_cipher_setiv(cipher_handle, ivec,
 							CIPHER_BLOCK);
 		if (error)
 			gcry_cipher_close(cipher_handle);
+		/* The counters of AES-CTR blocks are derived from it */
+		memcpy(key_data.ivec, ivec, CIPHER_BLOCK);
+		/* The "decode" threads need the key for ciphers of their own */
+		memcpy(key_data.key, key, KEY_SIZE);
 	}
 	return error;
 }
 #endif
 
+#ifdef CONFIG_COMPRESS
+/**
+ *	old_blocks_supported - check if images with the old block header can
+ *			be loaded
+ *
+ *	Compressed images saved before IMAGE_BLOCK_FLAGS was introduced have a
+ *	size_t in front of every block and always use LZO.  On 64-bit
+ *	little-endian systems that is laid out exactly like struct buf_block
+ *	with the flags equal to 0.
+ */
+static inline int old_blocks_supported(void)
+{
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	return sizeof(size_t) == 2 * sizeof(uint32_t);
+#else
+	return 0;
+#endif
+}
+
+static void reset_block_stats(void)
+{
+	int j;
+
+	nr_blocks = 0;
+	nr_raw_blocks = 0;
+	for (j = 0; j < BUF_BLOCK_LEVELS; j++)
+		nr_level_blocks[j] = 0;
+}
+
+/**
+ *	print_level_stats - print the numbers of blocks compressed at each level
+ *
+ *	This is only interesting if s2disk has chosen the compression level for
+ *	every block, so nothing is printed if one level has been used for all of
+ *	the compressed blocks.
+ */
+static void print_level_stats(void)
+{
+	int j, nr_levels = 0;
+
+	for (j = 0; j < BUF_BLOCK_LEVELS; j++)
+		if (nr_level_blocks[j])
+			nr_levels++;
+	if (nr_levels < 2)
+		return;
+
+	printf("%s: Compressed blocks per level:", my_name);
+	for (j = 0; j < BUF_BLOCK_LEVELS; j++)
+		if (nr_level_blocks[j])
+			printf(" %d: %lu", j, (unsigned long)nr_level_blocks[j]);
+	printf("\n");
+}
+#endif
+
 int read_or_verify(int dev, int fd, struct image_header_info *header,
 				   loff_t start, int verify, int test)
 {
@@ -608,12 +1143,14 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 	static unsigned char orig_checksum[16], checksum[16];
 	static char csum_buf[49];
 	int error = 0, test_mode = (verify || test);
+	int direct = 0;
 
 	error = read_page(fd, header, start);
 	if (error)
 		return error;
 
-	if ((header->flags & IMAGE_CHECKSUM) || verify) {
+	if (!(header->flags & IMAGE_BLOCK_CHECKSUM) &&
+	    ((header->flags & IMAGE_CHECKSUM) || verify)) {
 		memcpy(orig_checksum, header->checksum, 16);
 		print_checksum(csum_buf, orig_checksum);
 		printf("%s: MD5 checksum %s\n", my_name, csum_buf);
@@ -621,16 +1158,59 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 	}
 	splash.progress(10);
 	if (header->flags & IMAGE_COMPRESSED) {
-		printf("%s: Compressed image\n", my_name);
 #ifdef CONFIG_COMPRESS
-		if (lzo_init() == LZO_E_OK) {
-			do_decompress = 1;
+		if (header->flags & IMAGE_BLOCK_FLAGS)
+			decompressor = find_compressor(header->compress_method);
+		else
+			decompressor = find_compressor(COMPRESS_LZO);
+		if (!(header->flags & IMAGE_BLOCK_FLAGS) &&
+		    !old_blocks_supported()) {
+			fprintf(stderr, "%s: The image has been saved in an "
+				"old format\n", my_name);
+			error = -EINVAL;
+		} else if (!decompressor) {
+			fprintf(stderr, "%s: Compression method %d not "
+				"supported\n", my_name,
+				header->compress_method);
+			error = -EINVAL;
 		} else {
-			fprintf(stderr, "%s: Failed to initialize LZO\n",
-					my_name);
-			error = -EFAULT;
+			printf("%s: Compressed image (%s, level %d)\n",
+				my_name, decompressor->name,
+				header->compress_level);
+			if (!decompressor->init()) {
+				do_decompress = 1;
+				reset_block_stats();
+				do_unpack = !!(header->flags &
+							IMAGE_SPARSE_PAGES);
+				do_dedup = do_unpack && (header->flags &
+							IMAGE_DEDUP_PAGES);
+				nr_zero_pages = 0;
+				nr_sparse_pages = 0;
+				nr_dup_pages = 0;
+				block_checksum = NULL;
+			} else {
+				fprintf(stderr, "%s: Failed to initialize "
+					"%s\n", my_name, decompressor->name);
+				error = -EFAULT;
+			}
+		}
+		if (!error && (header->flags & IMAGE_BLOCK_CHECKSUM)) {
+			block_checksum = find_checksum_method(
+						header->checksum_method);
+			if (block_checksum && block_checksum->compute) {
+				checksum_init();
+				printf("%s: Block checksums (%s)\n", my_name,
+					block_checksum->name);
+			} else {
+				fprintf(stderr, "%s: Checksum method %d not "
+					"supported\n", my_name,
+					header->checksum_method);
+				block_checksum = NULL;
+				error = -EINVAL;
+			}
 		}
 #else
+		printf("%s: Compressed image\n", my_name);
 		fprintf(stderr, "%s: Compression not supported\n", my_name);
 		error = -EINVAL;
 #endif
@@ -640,11 +1220,14 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 
 	if (header->flags & IMAGE_ENCRYPTED) {
 #ifdef CONFIG_ENCRYPT
-		printf("%s: Encrypted image\n", my_name);
-		error = test_mode ?
-			gcry_cipher_setiv(cipher_handle, key_data.ivec,
-						CIPHER_BLOCK) :
-			restore_key(header);
+		aes_ctr = !!(header->flags & IMAGE_AES_CTR);
+		printf("%s: Encrypted image (%s)\n", my_name,
+			aes_ctr ? "AES-CTR" : "Blowfish-CFB");
+		if (!test_mode)
+			error = restore_key(header);
+		else if (!aes_ctr)
+			error = gcry_cipher_setiv(cipher_handle, key_data.ivec,
+						CIPHER_BLOCK);
 		if (error) {
 			fprintf(stderr, "%s: libgcrypt error: %s\n", my_name,
 					gcry_strerror(error));
@@ -660,8 +1243,8 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 	if (error)
 		goto Exit_encrypt;
 
-	error = init_swap_reader(&handle, fd, header->map_start,
-					header->image_data_size);
+	direct = swap_io_set_direct(fd, swap_io_direct);
+	error = init_swap_reader(&handle, fd, header);
 	if (!error) {
 		struct timeval begin, end;
 		double delta, mb;
@@ -706,6 +1289,19 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 
 			printf("%s: Compression ratio %4.2lf\n", my_name,
 				real_size / (header->pages * page_size));
+#ifdef CONFIG_COMPRESS
+			printf("%s: %lu of %lu blocks stored uncompressed\n",
+				my_name, nr_raw_blocks, nr_blocks);
+			print_level_stats();
+			if (do_unpack)
+				printf("%s: %lu zero pages and %lu sparse pages "
+					"eliminated\n", my_name,
+					nr_zero_pages, nr_sparse_pages);
+			if (do_dedup)
+				printf("%s: Duplicate pages %lu (%4.2lf%%)\n",
+					my_name, nr_dup_pages, 100.0 *
+					nr_dup_pages / header->pages);
+#endif
 			real_size /= (1024.0 * 1024.0);
 			delta -= header->writeout_time;
 
@@ -727,6 +1323,8 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 	}
 
  Exit_encrypt:
+	if (direct)
+		swap_io_set_direct(fd, 0);
 #ifdef CONFIG_ENCRYPT
 	if (do_decrypt && !test_mode)
 		gcry_cipher_close(cipher_handle);
@@ -734,3 +1332,21 @@ int read_or_verify(int dev, int fd, struct image_header_info *header,
 
 	return error;
 }
+
+/**
+ *	print_memalloc_stats - report how much of the memory pool was used
+ *
+ *	The high-water mark shows how close the pool sizes computed by main()
+ *	are to what is actually needed.
+ */
+void print_memalloc_stats(void)
+{
+	struct memalloc_stats stats;
+
+	memalloc_stats(&stats);
+	printf("%s: Memory pool %lu kB, peak usage %lu kB, "
+		"high-water mark %lu kB\n", my_name,
+		(unsigned long)(stats.size >> 10),
+		(unsigned long)(stats.peak >> 10),
+		(unsigned long)(stats.high_water >> 10));
+}
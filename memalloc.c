@@ -9,34 +9,123 @@
  *
  */
 
+#include "config.h"
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdatomic.h>
+#ifdef CONFIG_THREADS
+#include <pthread.h>
+#endif
 
 #include "memalloc.h"
 
 unsigned int page_size;
 unsigned int buffer_size;
 
+/*
+ * The memory is handed out from one chunk mapped by init_memalloc().  Nothing
+ * is mapped after that, because getmem() is called after the snapshot has been
+ * created, so if the pool turns out to be too small, getmem() fails.
+ *
+ * The chunk is divided into runs of pages, each of which is either free, used
+ * by one allocation of at least half a page, or split into objects of one
+ * small size class.  The first and the last page of every run record its
+ * length, so a freed run is merged with its free neighbours in constant time.
+ * Free runs are kept on lists by the power of 2 of their lengths, and free
+ * objects on one list per size class.
+ */
+
+/* Size of a huge page, which large chunks are aligned to */
+#define HUGE_PAGE_SIZE		(2UL << 20)
+/* Number of lists of free runs */
+#define RUN_LISTS		32
+/* Values of the class field for pages that don't belong to a size class */
+#define PAGE_FREE		-1
+#define PAGE_RUN		-2
+#define PAGE_TAIL		-3
+/* Maximum number of objects of one size class cached by a thread */
+#define THREAD_CACHE_OBJS	8
+
+/**
+ *	struct mem_page - state of one page of a chunk
+ *	@pages:	Length of the run the page belongs to (first and last page
+ *		only).
+ *	@class:	PAGE_FREE for all of the pages of a free run.  For a run in
+ *		use, PAGE_RUN or the size class of the objects in the page for
+ *		the first page and PAGE_TAIL for the other ones.
+ *	@prev:	Previous free run on the same list, or -1 (first page of a
+ *		free run only).
+ *	@next:	Next free run on the same list, or -1 (first page of a free
+ *		run only).
+ */
+struct mem_page {
+	unsigned int pages;
+	int class;
+	int prev;
+	int next;
+};
+
+struct mem_chunk {
+	void *base;
+	size_t size;
+	unsigned int nr_pages;
+	struct mem_page *map;
+	int free_runs[RUN_LISTS];
+};
+
 /* Mask used for page aligning */
 static size_t page_mask;
-/* Memory pool used for memory allocations */
-static void *mem_pool;
-/* Size of the pool */
-static size_t pool_size;
-/* The array of objects representig memory allocations */
-static struct mem_slot *slots;
-/* Size of the slots array */
-static unsigned int nr_slots;
-/* The struct mem_slot object to be used next */
-static struct mem_slot *cur_slot;
+static struct mem_chunk arena;
+/* Lists of free objects, linked through their first words */
+static void *free_objs[MEMALLOC_CLASSES];
+/* Number of size classes (objects of up to half a page) */
+static int nr_classes;
+/*
+ * Statistics.  The bytes held by the callers are counted outside of the arena
+ * lock, so that objects in the thread caches are not counted as used.
+ */
+static atomic_size_t in_use, peak;
+static size_t used_pages, high_water;
+
+#ifdef CONFIG_THREADS
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Small objects freed by a thread are cached for its next allocations of the
+ * same size, so that threads don't take the arena lock for them.
+ */
+static __thread struct thread_cache {
+	unsigned int count[MEMALLOC_CLASSES];
+	void *objs[MEMALLOC_CLASSES][THREAD_CACHE_OBJS];
+} thread_cache;
+
+static inline void arena_lock(void)
+{
+	pthread_mutex_lock(&arena_mutex);
+}
+
+static inline void arena_unlock(void)
+{
+	pthread_mutex_unlock(&arena_mutex);
+}
+#else
+static inline void arena_lock(void) {}
+static inline void arena_unlock(void) {}
+#endif
 
 void get_page_and_buffer_sizes(void)
 {
 	page_size = getpagesize();
 	page_mask = ~((size_t)page_size - 1);
 	buffer_size = page_size * BUFFER_PAGES;
+	nr_classes = 0;
+	while ((unsigned int)ALIGN_QWORD << nr_classes < page_size / 2 &&
+	    nr_classes < MEMALLOC_CLASSES - 1)
+		nr_classes++;
+	nr_classes++;
 }
 
 /**
@@ -59,140 +148,414 @@ size_t round_down_page_size(size_t size)
 	return size & page_mask;
 }
 
+static inline size_t class_size(int class)
+{
+	return (size_t)ALIGN_QWORD << class;
+}
+
 /**
- *	init_memalloc - initialize memory allocation structures
- *	@aux: Number of bytes for the internal use of the allocator
- *	@pool: Number of bytes to preallocate for the users
+ *	size_class - the size class of allocations of @size bytes, or -1 if
+ *		they take runs of pages
  */
-int init_memalloc(size_t aux, size_t pool)
+static int size_class(size_t size)
 {
-	void *mem;
-	unsigned long addr;
-	size_t slots_size;
+	int class = 0;
 
-	slots_size = round_up_page_size(aux);
-	pool_size = round_up_page_size(pool);
-	/* The additional page_size may be necessary for page alignment */
-	mem = malloc(slots_size + pool_size + page_size);
-	if (!mem)
+	while (class < nr_classes && class_size(class) < size)
+		class++;
+	return class < nr_classes ? class : -1;
+}
+
+static int run_list(unsigned int pages)
+{
+	int list = 0;
+
+	while (pages > 1 && list < RUN_LISTS - 1) {
+		pages >>= 1;
+		list++;
+	}
+	return list;
+}
+
+static void mark_run(struct mem_page *map, int i, unsigned int pages, int class)
+{
+	map[i].pages = pages;
+	map[i].class = class;
+	map[i + pages - 1].pages = pages;
+	map[i + pages - 1].class = class;
+}
+
+/**
+ *	mark_pages - set the class of @pages pages starting at page @i
+ */
+static void mark_pages(struct mem_page *map, int i, unsigned int pages,
+			int class)
+{
+	unsigned int j;
+
+	for (j = 0; j < pages; j++)
+		map[i + j].class = class;
+}
+
+static void add_free_run(struct mem_chunk *chunk, int i, unsigned int pages)
+{
+	struct mem_page *map = chunk->map;
+	int *head = chunk->free_runs + run_list(pages);
+
+	mark_run(map, i, pages, PAGE_FREE);
+	map[i].prev = -1;
+	map[i].next = *head;
+	if (*head >= 0)
+		map[*head].prev = i;
+	*head = i;
+}
+
+static void del_free_run(struct mem_chunk *chunk, int i)
+{
+	struct mem_page *map = chunk->map;
+
+	if (map[i].prev >= 0)
+		map[map[i].prev].next = map[i].next;
+	else
+		chunk->free_runs[run_list(map[i].pages)] = map[i].next;
+	if (map[i].next >= 0)
+		map[map[i].next].prev = map[i].prev;
+}
+
+/**
+ *	alloc_run - take a run of @pages pages from @chunk
+ *	@class:	PAGE_RUN or the size class the run will be split into.
+ *
+ *	Returns the index of the first page of the run, or -1 if there are
+ *	no free runs long enough in @chunk.
+ */
+static int alloc_run(struct mem_chunk *chunk, unsigned int pages, int class)
+{
+	struct mem_page *map = chunk->map;
+	int list, i;
+
+	for (list = run_list(pages); list < RUN_LISTS; list++)
+		for (i = chunk->free_runs[list]; i >= 0; i = map[i].next) {
+			unsigned int left;
+
+			if (map[i].pages < pages)
+				continue;
+			left = map[i].pages - pages;
+			del_free_run(chunk, i);
+			if (left)
+				add_free_run(chunk, i + pages, left);
+			mark_run(map, i, pages, class);
+			mark_pages(map, i + 1, pages - 1, PAGE_TAIL);
+			return i;
+		}
+	return -1;
+}
+
+/**
+ *	free_run - return the run starting at page @i to @chunk and merge it
+ *		with its free neighbours
+ */
+static void free_run(struct mem_chunk *chunk, int i)
+{
+	struct mem_page *map = chunk->map;
+	unsigned int start = i, end = i + map[i].pages;
+
+	mark_pages(map, i, map[i].pages, PAGE_FREE);
+	if (start > 0 && map[start - 1].class == PAGE_FREE) {
+		start -= map[start - 1].pages;
+		del_free_run(chunk, start);
+	}
+	if (end < chunk->nr_pages && map[end].class == PAGE_FREE) {
+		del_free_run(chunk, end);
+		end += map[end].pages;
+	}
+	add_free_run(chunk, start, end - start);
+}
+
+/**
+ *	map_chunk - map a chunk of at least @size bytes
+ *
+ *	Chunks of at least HUGE_PAGE_SIZE are backed with huge pages, if there
+ *	are any reserved, or aligned to HUGE_PAGE_SIZE and marked for
+ *	transparent huge pages otherwise, to reduce the TLB misses in the loops
+ *	going through the buffers of the pipeline.
+ */
+static int map_chunk(struct mem_chunk *chunk, size_t size)
+{
+	void *mem = MAP_FAILED;
+	int j;
+
+	size = round_up_page_size(size);
+	if (size >= HUGE_PAGE_SIZE) {
+		size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (mem == MAP_FAILED) {
+			unsigned long addr, start;
+
+			mem = mmap(NULL, size + HUGE_PAGE_SIZE,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED)
+				return -ENOMEM;
+			addr = (unsigned long)mem;
+			start = (addr + HUGE_PAGE_SIZE - 1) &
+					~(HUGE_PAGE_SIZE - 1);
+			if (start > addr)
+				munmap(mem, start - addr);
+			munmap((void *)(start + size),
+				addr + HUGE_PAGE_SIZE - start);
+			mem = (void *)start;
+#ifdef MADV_HUGEPAGE
+			madvise(mem, size, MADV_HUGEPAGE);
+#endif
+		}
+	} else {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return -ENOMEM;
+	}
+	chunk->nr_pages = size / page_size;
+	chunk->map = malloc(chunk->nr_pages * sizeof(struct mem_page));
+	if (!chunk->map) {
+		munmap(mem, size);
 		return -ENOMEM;
-	slots = mem;
-	nr_slots = slots_size / sizeof(struct mem_slot);
-	cur_slot = slots;
-	/* Make the pool address be page aligned */
-	mem += slots_size;
-	addr = ((unsigned long)mem & ~((unsigned long)page_size - 1));
-	if (addr < (unsigned long)mem)
-		mem = (void *)(addr + page_size);
-	mem_pool = mem;
+	}
+	chunk->base = mem;
+	chunk->size = size;
+	for (j = 0; j < RUN_LISTS; j++)
+		chunk->free_runs[j] = -1;
+	mark_pages(chunk->map, 0, chunk->nr_pages, PAGE_FREE);
+	add_free_run(chunk, 0, chunk->nr_pages);
 	return 0;
 }
 
+/**
+ *	get_pages - take a run of @pages pages from the arena
+ */
+static void *get_pages(unsigned int pages, int class)
+{
+	int i;
+
+	i = alloc_run(&arena, pages, class);
+	if (i < 0)
+		return NULL;
+	used_pages += pages;
+	if (used_pages * page_size > high_water)
+		high_water = used_pages * page_size;
+	return arena.base + (size_t)i * page_size;
+}
+
+static void *get_object(int class)
+{
+	void *obj = free_objs[class];
+	size_t size = class_size(class);
+
+	if (!obj) {
+		void *page = get_pages(1, class);
+		size_t offset;
+
+		if (!page)
+			return NULL;
+		/* Split the page into objects, lowest addresses going first */
+		for (offset = page_size; offset > 0; offset -= size) {
+			*(void **)(page + offset - size) = obj;
+			obj = page + offset - size;
+		}
+	}
+	free_objs[class] = *(void **)obj;
+	return obj;
+}
+
+static void put_object(int class, void *obj)
+{
+	*(void **)obj = free_objs[class];
+	free_objs[class] = obj;
+}
+
+static void count_alloc(size_t size)
+{
+	size_t used = atomic_fetch_add(&in_use, size) + size;
+	size_t max = atomic_load(&peak);
+
+	while (used > max && !atomic_compare_exchange_weak(&peak, &max, used))
+		;
+}
+
+static inline void count_free(size_t size)
+{
+	atomic_fetch_sub(&in_use, size);
+}
+
+/**
+ *	init_memalloc - initialize memory allocation structures
+ *	@pool: Number of bytes to preallocate for the users
+ *
+ *	All of the memory needed must be preallocated, because getmem() may
+ *	be called after the snapshot has been created, when the system may
+ *	not have much memory left.  On top of @pool, one page is reserved for
+ *	every size class of small objects, which the objects of that class
+ *	are taken from.
+ */
+int init_memalloc(size_t pool)
+{
+	int class;
+
+	for (class = 0; class < MEMALLOC_CLASSES; class++)
+		free_objs[class] = NULL;
+	atomic_init(&in_use, 0);
+	atomic_init(&peak, 0);
+	used_pages = high_water = 0;
+	return map_chunk(&arena, round_up_page_size(pool) +
+				(size_t)nr_classes * page_size);
+}
+
 /**
  *	getmem - get some memory from the preallocated pool
  *	@size: Number of bytes needed
  *
  *	Return the address of @size bytes of memory, aligned to the first
  *	natural power of 2 greater than or equal to @size and not greater than
- *	page_size.
+ *	page_size, or NULL if there is not enough memory left in the pool.
  */
 void *getmem(size_t size)
 {
-	void *addr = mem_pool;
-	size_t used;
+	int class = size_class(size);
+	void *addr;
 
-	if (cur_slot - slots >= nr_slots) {
-		fprintf(stderr, "WARNING: Not enough memory slots\n");
-		return NULL;
+#ifdef CONFIG_THREADS
+	if (class >= 0 && thread_cache.count[class]) {
+		count_alloc(class_size(class));
+		return thread_cache.objs[class][--thread_cache.count[class]];
 	}
-	if (cur_slot > slots) {
-		unsigned int align_size, align_mask;
-		struct mem_slot *last_slot = cur_slot - 1;
-
-		if (size >= page_size) {
-			align_size = page_size;
-			align_mask = page_mask;
-		} else {
-			align_size = ALIGN_QWORD;
-			while (align_size < size)
-				align_size <<= 1;
-			align_mask = ~(align_size - 1);
-		}
-		addr += ((last_slot->addr - mem_pool + last_slot->size +
-			align_size - 1) & align_mask);
+#endif
+	arena_lock();
+	if (class >= 0) {
+		addr = get_object(class);
+#ifdef CONFIG_THREADS
+		/* Take some more objects of that size, if they are free */
+		while (addr && free_objs[class] &&
+		    thread_cache.count[class] < THREAD_CACHE_OBJS / 2)
+			thread_cache.objs[class][thread_cache.count[class]++] =
+							get_object(class);
+#endif
+		size = class_size(class);
+	} else {
+		size_t pages = round_up_page_size(size) / page_size;
+
+		addr = get_pages(pages, PAGE_RUN);
+		size = pages * page_size;
 	}
-	used = addr - mem_pool;
-	if (used > pool_size || size > pool_size - used) {
+	arena_unlock();
+	if (addr)
+		count_alloc(size);
+	else
 		fprintf(stderr, "WARNING: Not enough memory in the pool\n");
-		return NULL;
-	}
-	cur_slot->addr = addr;
-	cur_slot->size = size;
-	cur_slot++;
 	return addr;
 }
 
-/**
- *	free_slot - mark given memory slot as freed and try to remove it
- *	@slot: Number of memory slot to free
- */
-static void free_slot(int slot)
-{
-	struct mem_slot *last_slot = cur_slot - 1;
-
-	/*
-	 * To free the slot, set its size to zero.  If this is the most recently
-	 * allocated one, remove it from the array along with some other already
-	 * freed slots (the size of the last remaining slot must be greater than
-	 * zero).
-	 */
-	slots[slot].size = 0;
-	if (slots + slot == last_slot) {
-		do
-			last_slot--;
-		while (!last_slot->size && last_slot >= slots);
-		cur_slot = last_slot + 1;
-	}
-}
-
 /**
  *	freemem - free memory allocated by getmem
  *	@address: Start of the memory area to free
+ *
+ *	Addresses that have not been returned by getmem() (for example, the ones
+ *	pointing to the middle of an allocation) and the ones that have been
+ *	freed already are rejected with a warning.
  */
 void freemem(void *address)
 {
-	int i, j, k;
+	size_t offset;
+	int i, class;
 
-	/* Check if there is anything to do */
-	if (cur_slot <= slots)
+	if (!address)
 		return;
-	/* Find the slot to free, using the observation that they are sorted */
-	i = 0;
-	j = cur_slot - slots - 1;
-	do {
-		k = (i + j) / 2;
-		if (slots[k].addr == address) {
-			free_slot(k);
-			break;
-		} else if (address > slots[k].addr) {
-			if (i != k) {
-				i = k;
-			} else {
-				if (slots[j].addr == address)
-					free_slot(j);
-				break;
-			}
-		} else {
-			j = k;
+	if (address < arena.base || address >= arena.base + arena.size)
+		goto Invalid;
+	offset = address - arena.base;
+	i = offset / page_size;
+	class = arena.map[i].class;
+	if (class >= 0 ? offset % class_size(class) :
+	    class != PAGE_RUN || offset % page_size)
+		goto Invalid;
+#ifdef CONFIG_THREADS
+	if (class >= 0) {
+		unsigned int *count = thread_cache.count + class;
+
+		count_free(class_size(class));
+		if (*count == THREAD_CACHE_OBJS) {
+			/* Give half of the cached objects back */
+			arena_lock();
+			while (*count > THREAD_CACHE_OBJS / 2)
+				put_object(class,
+					thread_cache.objs[class][--(*count)]);
+			arena_unlock();
 		}
-	} while (i < j);
+		thread_cache.objs[class][(*count)++] = address;
+		return;
+	}
+#endif
+	arena_lock();
+	if (class >= 0) {
+		count_free(class_size(class));
+		put_object(class, address);
+	} else {
+		count_free((size_t)arena.map[i].pages * page_size);
+		used_pages -= arena.map[i].pages;
+		free_run(&arena, i);
+	}
+	arena_unlock();
+	return;
+
+ Invalid:
+	fprintf(stderr, "WARNING: Attempt to free invalid address %p\n",
+		address);
 }
 
 /**
- *	end_memalloc - free memory used by the allocator
+ *	memalloc_thread_exit - give the objects cached by the current thread
+ *		back to the pool
+ */
+void memalloc_thread_exit(void)
+{
+#ifdef CONFIG_THREADS
+	int class;
+
+	arena_lock();
+	for (class = 0; class < nr_classes; class++)
+		while (thread_cache.count[class])
+			put_object(class, thread_cache.objs[class]
+					[--thread_cache.count[class]]);
+	arena_unlock();
+#endif
+}
+
+/**
+ *	memalloc_stats - get the statistics of the allocator
+ *
+ *	Small objects cached by threads are not counted as used.
+ */
+void memalloc_stats(struct memalloc_stats *stats)
+{
+	arena_lock();
+	stats->size = arena.size;
+	stats->peak = atomic_load(&peak);
+	stats->high_water = high_water;
+	arena_unlock();
+}
+
+/**
+ *	free_memalloc - free memory used by the allocator
  */
 void free_memalloc(void)
 {
-	if (slots)
-		free(slots);
+	memalloc_thread_exit();
+	if (arena.base) {
+		munmap(arena.base, arena.size);
+		free(arena.map);
+		arena.base = NULL;
+		arena.size = 0;
+	}
 }
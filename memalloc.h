@@ -9,13 +9,24 @@
  *
  */
 
-struct mem_slot {
-	void *addr;
+/**
+ *	struct memalloc_stats - statistics of the allocator
+ *	@size:		Number of bytes in the pool.
+ *	@peak:		Maximum number of bytes allocated at the same time.
+ *	@high_water:	Maximum number of bytes of the pool used at the same
+ *			time, including the pages holding small objects.
+ */
+struct memalloc_stats {
 	size_t size;
+	size_t peak;
+	size_t high_water;
 };
 
 #define ALIGN_QWORD	8
 
+/* Maximum number of size classes of objects smaller than a page */
+#define MEMALLOC_CLASSES	16
+
 #define BUFFER_PAGES	32
 
 extern unsigned int page_size;
@@ -25,7 +36,9 @@ extern unsigned int buffer_size;
 extern void get_page_and_buffer_sizes(void);
 extern size_t round_up_page_size(size_t size);
 extern size_t round_down_page_size(size_t size);
-extern int init_memalloc(size_t aux, size_t pool);
+extern int init_memalloc(size_t pool);
 extern void *getmem(size_t size);
 extern void freemem(void *address);
+extern void memalloc_thread_exit(void);
+extern void memalloc_stats(struct memalloc_stats *stats);
 extern void free_memalloc(void);
@@ -0,0 +1,204 @@
+/*
+ * page-pass-bench.c
+ *
+ * Compare the ways s2disk can add image data pages to the image checksum:
+ * one page at a time right after it has been read (and classified), or in a
+ * separate pass over every block once the block is full.
+ *
+ * The reads from /dev/snapshot are simulated by copying the pages from an
+ * image in memory that is much larger than the CPU caches.  Compression and
+ * encryption are not included, as they work on whole blocks either way.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memalloc.h"
+#include "md5.h"
+#include "classify.h"
+
+/* 256 MB with 4 KB pages */
+#define NR_PAGES	(1 << 16)
+#define NR_RUNS		5
+
+#define FMT_RAW		0
+#define FMT_SPARSE	1
+#define FMT_DEDUP	2
+
+static const char *format_names[] = { "raw", "sparse", "dedup" };
+
+static char *image;
+static unsigned long nr_pages;
+static char *buffer;
+static struct page_cache page_cache;
+
+/**
+ *	fill_image - make an image with a mix of page types
+ *
+ *	One in four pages is empty, one in four is sparse, one in eight
+ *	duplicates a recent page and the rest are full of pseudorandom data.
+ */
+static void fill_image(void)
+{
+	const unsigned int nr_words = page_size / sizeof(uint64_t);
+	uint64_t x = 88172645463325252ULL;
+	unsigned long i;
+	unsigned int j;
+
+	for (i = 0; i < nr_pages; i++) {
+		uint64_t *words = (uint64_t *)(image + i * page_size);
+
+		switch (i % 8) {
+		case 0:
+		case 4:
+			memset(words, 0, page_size);
+			break;
+		case 1:
+		case 5:
+			memset(words, 0, page_size);
+			for (j = 0; j < nr_words; j += 16) {
+				x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+				words[j] = x;
+			}
+			break;
+		case 6:
+			if (i >= 64) {
+				memcpy(words, image + (i - 61) * page_size,
+					page_size);
+				break;
+			}
+			/* fall through */
+		default:
+			for (j = 0; j < nr_words; j++) {
+				x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+				words[j] = x;
+			}
+		}
+	}
+}
+
+/**
+ *	save - go through the image as save_image() does
+ *	@format:	Format of the image data.
+ *	@fused:		Checksum every page right after it has been read,
+ *			instead of checksumming every full block.
+ *	@digest:	The checksum of the image, written.
+ *
+ *	Return the time taken in seconds.
+ */
+static double save(int format, int fused, unsigned char *digest)
+{
+	const size_t room = format == FMT_RAW ? page_size :
+				PAGE_RECORD_HEADER_SIZE + page_size;
+	struct page_cache *cache = format == FMT_DEDUP ? &page_cache : NULL;
+	char *limit = buffer + buffer_size - room;
+	struct timeval begin, end;
+	struct md5_ctx ctx;
+	unsigned long i;
+	char *ptr;
+	size_t size;
+
+	if (cache) {
+		free_page_cache(cache);
+		init_page_cache(cache, 1);
+	}
+	md5_init_ctx(&ctx);
+	gettimeofday(&begin, NULL);
+	ptr = buffer;
+	for (i = 0; i < nr_pages; i++) {
+		if (ptr > limit) {
+			if (!fused)
+				md5_process_bytes(buffer, ptr - buffer, &ctx);
+			ptr = buffer;
+		}
+		if (format == FMT_RAW) {
+			memcpy(ptr, image + i * page_size, page_size);
+			size = page_size;
+		} else {
+			memcpy(ptr + PAGE_RECORD_HEADER_SIZE,
+				image + i * page_size, page_size);
+			size = pack_page(ptr, cache);
+		}
+		if (fused)
+			md5_process_bytes(ptr, size, &ctx);
+		ptr += size;
+	}
+	if (!fused)
+		md5_process_bytes(buffer, ptr - buffer, &ctx);
+	md5_finish_ctx(&ctx, digest);
+	gettimeofday(&end, NULL);
+	timersub(&end, &begin, &end);
+	return end.tv_sec + end.tv_usec / 1000000.0;
+}
+
+static int compare_times(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ *	run - measure one format of the image data, both ways
+ *
+ *	The median of NR_RUNS runs is printed for each of them.
+ */
+static void run(int format)
+{
+	unsigned char digest[2][16];
+	double times[2][NR_RUNS], mb;
+	int fused, j;
+
+	for (j = 0; j < NR_RUNS; j++)
+		for (fused = 0; fused < 2; fused++)
+			times[fused][j] = save(format, fused, digest[fused]);
+
+	mb = (double)nr_pages * page_size / (1 << 20);
+	for (fused = 0; fused < 2; fused++) {
+		double time;
+
+		qsort(times[fused], NR_RUNS, sizeof(double), compare_times);
+		time = times[fused][NR_RUNS / 2];
+		printf("%-8s %-9s %8.1lf ns/page %8.1lf MB/s\n",
+			format_names[format], fused ? "per page" : "per block",
+			time * 1e9 / nr_pages, time ? mb / time : 0.0);
+	}
+	if (memcmp(digest[0], digest[1], sizeof(digest[0])))
+		fprintf(stderr, "%s: checksums differ\n",
+			format_names[format]);
+}
+
+int main(int argc, char *argv[])
+{
+	int format;
+
+	get_page_and_buffer_sizes();
+	nr_pages = argc > 1 ? strtoul(argv[1], NULL, 0) : NR_PAGES;
+	if (!nr_pages)
+		nr_pages = NR_PAGES;
+	image = malloc(nr_pages * page_size);
+	if (!image || init_memalloc(buffer_size + page_cache_size(1))) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	buffer = getmem(buffer_size);
+	if (!buffer || init_page_cache(&page_cache, 1)) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	classify_init();
+	fill_image();
+
+	printf("%lu pages\n", nr_pages);
+	for (format = FMT_RAW; format <= FMT_DEDUP; format++)
+		run(format);
+	return 0;
+}
@@ -0,0 +1,575 @@
+/*
+ * pipeline.c
+ *
+ * Engine passing blocks of image data through a sequence of processing
+ * stages, possibly run by worker threads.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "memalloc.h"
+#include "pipeline.h"
+
+/* Value of the error field after pipeline_stop() */
+#define STOPPED		1
+/* Value of the end field until the source stage runs out of data */
+#define NO_END		ULONG_MAX
+/* Number of times to poll for a condition before sleeping */
+#define WAIT_SPIN	64
+
+/*
+ * Every block slot is used for the blocks whose sequence numbers are equal to
+ * the slot number modulo the pipeline depth, so a block can only be taken out
+ * of the pool after the previous user of its slot has been released.  Since
+ * each stage takes the blocks in order, the slot of the next block a stage is
+ * waiting for cannot be reused before that stage has taken it.  Hence, the
+ * stages don't need queues of their own; a stage is ready to take block i if
+ * the slot of that block holds block i and its stage field points to the
+ * stage.
+ *
+ * Threads waiting for something sleep on the futex of one of the pipeline's
+ * events, but the threads that change the state only make the system call to
+ * wake them up if they are known to be sleeping.
+ */
+
+/**
+ *	wake - wake up the threads waiting on @ev, if there are any
+ *
+ *	This must be called after changing the state the waiters wait for.
+ *	If wait_event() has not seen @waiters incremented yet, it is guaranteed
+ *	to see the new state before going to sleep.
+ */
+static void wake(struct pipeline_event *ev)
+{
+	if (!atomic_load(&ev->waiters))
+		return;
+
+	atomic_fetch_add(&ev->seq, 1);
+	syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+			NULL, NULL, 0);
+}
+
+/**
+ *	wait_event - wait until @ready(@p, @arg) is true or an error occurs
+ *
+ *	Return the error code of @p.
+ */
+static int wait_event(struct pipeline *p, struct pipeline_event *ev,
+		int (*ready)(struct pipeline *, unsigned long), unsigned long arg)
+{
+	int spin;
+
+	/* The other side is usually about to catch up, don't sleep at once */
+	for (spin = 0; spin < WAIT_SPIN && !ready(p, arg); spin++)
+		sched_yield();
+
+	while (!ready(p, arg) && !atomic_load(&p->error)) {
+		unsigned int seq;
+
+		atomic_fetch_add(&ev->waiters, 1);
+		seq = atomic_load(&ev->seq);
+		if (!ready(p, arg) && !atomic_load(&p->error))
+			syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq,
+					NULL, NULL, 0);
+		atomic_fetch_sub(&ev->waiters, 1);
+	}
+	return atomic_load(&p->error);
+}
+
+static void wake_all(struct pipeline *p)
+{
+	int j;
+
+	for (j = 0; j <= p->nr_stages; j++)
+		wake(p->events + j);
+}
+
+/**
+ *	set_error - record the first error and make all workers stop
+ */
+static void set_error(struct pipeline *p, int error)
+{
+	int none = 0;
+
+	atomic_compare_exchange_strong(&p->error, &none, error);
+	wake_all(p);
+}
+
+static inline struct pipeline_block *slot(struct pipeline *p, unsigned long i)
+{
+	return p->blocks + i % p->depth;
+}
+
+static int block_free(struct pipeline *p, unsigned long i)
+{
+	return !atomic_load(&slot(p, i)->refcount);
+}
+
+static int block_queued(struct pipeline *p, unsigned long stage)
+{
+	unsigned long i = atomic_load(&p->next[stage]);
+	struct pipeline_block *block = slot(p, i);
+
+	return atomic_load(&block->stage) == (int)stage && block->index == i;
+}
+
+static int block_done(struct pipeline *p, unsigned long i)
+{
+	struct pipeline_block *block = slot(p, i);
+
+	if (atomic_load(&p->end) <= i)
+		return 1;
+	return atomic_load(&block->stage) == p->nr_stages && block->index == i;
+}
+
+static int all_completed(struct pipeline *p, unsigned long n)
+{
+	return atomic_load(&p->completed) == n;
+}
+
+static void init_block(struct pipeline_block *block, unsigned long i)
+{
+	block->index = i;
+	block->size = 0;
+	atomic_store(&block->refcount, 1);
+	atomic_store(&block->stage, -1);
+}
+
+/**
+ *	advance - pass a block to the given stage
+ *	@worker:	Number of the worker thread calling this function.
+ *
+ *	The stages without worker threads are run right away, by the caller.
+ */
+static int advance(struct pipeline *p, struct pipeline_block *block, int stage,
+			int worker)
+{
+	struct pipeline_stage *s;
+	int error;
+
+	for (s = p->stages + stage; stage < p->nr_stages && !s->workers;
+							stage++, s++) {
+		error = s->process(block, worker, s->data);
+		if (error) {
+			set_error(p, error);
+			return error;
+		}
+	}
+
+	atomic_store(&block->stage, stage);
+	if (stage < p->nr_stages) {
+		wake(p->events + stage);
+	} else {
+		atomic_fetch_add(&p->completed, 1);
+		wake(p->events + p->nr_stages);
+		if (!p->deliver)
+			pipeline_release(p, block);
+	}
+	return 0;
+}
+
+/**
+ *	produce - let the source stage fill the next block
+ */
+static int produce(struct pipeline *p, int worker)
+{
+	unsigned long i = atomic_load(&p->next[0]);
+	struct pipeline_block *block = slot(p, i);
+	int error;
+
+	error = wait_event(p, p->events + p->nr_stages, block_free, i);
+	if (error)
+		return error;
+
+	init_block(block, i);
+	atomic_store(&p->next[0], i + 1);
+	error = p->stages[0].process(block, worker, p->stages[0].data);
+	if (error == PIPELINE_END) {
+		atomic_store(&p->end, i);
+		pipeline_release(p, block);
+		wake(p->events + p->nr_stages);
+		return error;
+	} else if (error) {
+		set_error(p, error);
+		return error;
+	}
+	return advance(p, block, 1, worker);
+}
+
+/**
+ *	claim - take the next block waiting for the given stage, if ready
+ */
+static struct pipeline_block *claim(struct pipeline *p, int stage)
+{
+	unsigned long i = atomic_load(&p->next[stage]);
+	struct pipeline_block *block = slot(p, i);
+
+	if (atomic_load(&block->stage) != stage || block->index != i)
+		return NULL;
+	if (!atomic_compare_exchange_strong(&p->next[stage], &i, i + 1))
+		return NULL;
+	return block;
+}
+
+#ifdef CONFIG_THREADS
+static void run_worker(struct pipeline_worker *w)
+{
+	struct pipeline *p = w->pipeline;
+	struct pipeline_stage *s = p->stages + w->stage;
+	struct pipeline_block *block;
+	int error;
+
+	if (p->source && !w->stage) {
+		while (!produce(p, w->nr))
+			;
+		return;
+	}
+
+	for (;;) {
+		while (!(block = claim(p, w->stage)))
+			if (wait_event(p, p->events + w->stage, block_queued,
+					w->stage))
+				return;
+
+		error = s->process(block, w->nr, s->data);
+		if (error) {
+			set_error(p, error);
+			return;
+		}
+		if (advance(p, block, w->stage + 1, w->nr))
+			return;
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	run_worker(arg);
+	memalloc_thread_exit();
+	return NULL;
+}
+#endif
+
+/**
+ *	pipeline_mem_size - amount of memory needed by pipeline_init()
+ */
+size_t pipeline_mem_size(unsigned int depth, size_t block_size, int aux)
+{
+	size_t size;
+
+	size = round_up_page_size(depth * sizeof(struct pipeline_block));
+	size += depth * block_size;
+	if (aux)
+		size += depth * block_size;
+	return size;
+}
+
+/**
+ *	reset - put a pipeline and all of its blocks into the initial state
+ */
+static void reset(struct pipeline *p)
+{
+	unsigned int j;
+
+	atomic_init(&p->error, 0);
+	atomic_init(&p->completed, 0);
+	atomic_init(&p->end, NO_END);
+	p->issued = 0;
+	p->submitted = 0;
+	p->received = 0;
+	for (j = 0; j < PIPELINE_STAGES_MAX; j++)
+		atomic_init(&p->next[j], 0);
+	for (j = 0; j <= PIPELINE_STAGES_MAX; j++) {
+		atomic_init(&p->events[j].seq, 0);
+		atomic_init(&p->events[j].waiters, 0);
+	}
+	for (j = 0; j < p->depth; j++) {
+		atomic_init(&p->blocks[j].refcount, 0);
+		atomic_init(&p->blocks[j].stage, -1);
+	}
+}
+
+/**
+ *	pipeline_init - initialize a pipeline and allocate its pool of blocks
+ *	@depth:		Number of blocks in the pool.
+ *	@block_size:	Size of a block buffer (multiple of page_size).
+ *	@aux:		If set, every block has a scratch buffer too.
+ */
+int pipeline_init(struct pipeline *p, unsigned int depth, size_t block_size,
+			int aux)
+{
+	unsigned int j;
+
+	memset(p, 0, sizeof(*p));
+	p->depth = depth;
+	p->block_size = block_size;
+	p->blocks = getmem(depth * sizeof(struct pipeline_block));
+	if (!p->blocks)
+		return -ENOMEM;
+	p->data_buffers = getmem(depth * block_size);
+	if (!p->data_buffers)
+		goto Free_blocks;
+	if (aux) {
+		p->aux_buffers = getmem(depth * block_size);
+		if (!p->aux_buffers)
+			goto Free_data;
+	}
+
+	for (j = 0; j < depth; j++) {
+		struct pipeline_block *block = p->blocks + j;
+
+		block->index = 0;
+		block->data = (char *)p->data_buffers + j * block_size;
+		block->aux = aux ? (char *)p->aux_buffers + j * block_size :
+									NULL;
+		block->size = 0;
+	}
+	reset(p);
+	return 0;
+
+ Free_data:
+	freemem(p->data_buffers);
+ Free_blocks:
+	freemem(p->blocks);
+	return -ENOMEM;
+}
+
+/**
+ *	pipeline_add_stage - append a stage to a pipeline
+ *
+ *	At most PIPELINE_STAGES_MAX stages can be added.
+ */
+void pipeline_add_stage(struct pipeline *p, const char *name,
+			int (*process)(struct pipeline_block *, int, void *),
+			void *data, int workers)
+{
+	struct pipeline_stage *s;
+
+	if (p->nr_stages >= PIPELINE_STAGES_MAX)
+		return;
+
+	s = p->stages + p->nr_stages++;
+	s->name = name;
+	s->process = process;
+	s->data = data;
+	s->workers = workers > 0 ? workers : 0;
+}
+
+/**
+ *	pipeline_start - start the worker threads of a pipeline
+ *	@source:	If set, the first stage fills empty blocks itself.
+ *	@deliver:	If set, the blocks are passed to pipeline_receive() after
+ *			the last stage.
+ *
+ *	If the worker threads cannot be started, all of the stages are run by
+ *	the callers of pipeline_submit() and pipeline_receive().  Blocks may be
+ *	obtained with pipeline_get_block() and filled before this is called.
+ *
+ *	A stage without worker threads must not follow a stage with more than
+ *	one of them, because it would be run by all of them at the same time
+ *	and get the blocks out of order.  Such pipelines are not started and
+ *	fail with -EINVAL.
+ */
+int pipeline_start(struct pipeline *p, int source, int deliver)
+{
+	int j;
+#ifdef CONFIG_THREADS
+	int k;
+#endif
+
+	p->source = !!source;
+	p->deliver = !!deliver;
+	if (p->source && p->stages[0].workers > 1)
+		p->stages[0].workers = 1;
+
+	p->nr_workers = 0;
+#ifdef CONFIG_THREADS
+	for (j = 0; j < p->nr_stages; j++) {
+		struct pipeline_stage *s = p->stages + j;
+
+		if (p->nr_workers + s->workers > PIPELINE_WORKERS_MAX)
+			s->workers = PIPELINE_WORKERS_MAX - p->nr_workers;
+		p->nr_workers += s->workers;
+	}
+	for (j = 1; j < p->nr_stages; j++)
+		if (!p->stages[j].workers && p->stages[j - 1].workers > 1) {
+			fprintf(stderr, "Pipeline stage \"%s\" has no "
+				"threads, but follows \"%s\"\n",
+				p->stages[j].name, p->stages[j - 1].name);
+			p->nr_workers = 0;
+			set_error(p, -EINVAL);
+			return -EINVAL;
+		}
+	/*
+	 * Start the workers of the last stage first, so that the source stage
+	 * hasn't produced anything if any of them cannot be started.
+	 */
+	for (j = p->nr_stages - 1, k = p->nr_workers; j >= 0; j--) {
+		struct pipeline_stage *s = p->stages + j;
+		int nr;
+
+		for (nr = 0; nr < s->workers; nr++) {
+			struct pipeline_worker *w = p->workers + --k;
+			int error;
+
+			w->pipeline = p;
+			w->stage = j;
+			w->nr = nr;
+			error = pthread_create(&w->th, NULL, worker_thread, w);
+			if (error) {
+				errno = error;
+				perror("pthread_create() failed:");
+				goto Run_inline;
+			}
+		}
+	}
+	return 0;
+
+ Run_inline:
+	/* Only the workers above k have been started */
+	set_error(p, STOPPED);
+	for (j = k + 1; j < p->nr_workers; j++)
+		pthread_join(p->workers[j].th, NULL);
+	p->nr_workers = 0;
+	atomic_store(&p->error, 0);
+#endif
+	for (j = 0; j < p->nr_stages; j++)
+		p->stages[j].workers = 0;
+	return 0;
+}
+
+/**
+ *	pipeline_get_block - get an empty block to fill and pass to
+ *			pipeline_submit()
+ *
+ *	Wait until the next block is available.  Return NULL on errors.
+ */
+struct pipeline_block *pipeline_get_block(struct pipeline *p)
+{
+	unsigned long i = p->issued;
+	struct pipeline_block *block = slot(p, i);
+
+	if (wait_event(p, p->events + p->nr_stages, block_free, i))
+		return NULL;
+	init_block(block, i);
+	p->issued++;
+	return block;
+}
+
+/**
+ *	pipeline_submit - pass a block filled with data to the first stage
+ *
+ *	The blocks must be submitted in the order in which they have been
+ *	obtained from pipeline_get_block().
+ */
+int pipeline_submit(struct pipeline *p, struct pipeline_block *block)
+{
+	int error;
+
+	p->submitted++;
+	error = advance(p, block, 0, 0);
+	return error ? error : pipeline_error(p);
+}
+
+/**
+ *	pipeline_receive - get the next block that has passed the last stage
+ *
+ *	Return NULL if there are no more blocks or on errors (see
+ *	pipeline_error()).  The block has to be given back with
+ *	pipeline_release().
+ */
+struct pipeline_block *pipeline_receive(struct pipeline *p)
+{
+	unsigned long i = p->received;
+
+	if (p->source && !p->stages[0].workers &&
+	    atomic_load(&p->next[0]) == i && atomic_load(&p->end) == NO_END) {
+		/* Nobody else is going to fill the block */
+		if (produce(p, 0) < 0)
+			return NULL;
+	}
+	if (wait_event(p, p->events + p->nr_stages, block_done, i))
+		return NULL;
+	if (atomic_load(&p->end) <= i)
+		return NULL;
+	p->received++;
+	return slot(p, i);
+}
+
+/**
+ *	pipeline_release - drop a reference to a block
+ */
+void pipeline_release(struct pipeline *p, struct pipeline_block *block)
+{
+	if (atomic_fetch_sub(&block->refcount, 1) == 1)
+		wake(p->events + p->nr_stages);
+}
+
+/**
+ *	pipeline_set_error - make a pipeline fail
+ *
+ *	For errors detected outside of the stages, like failures of the I/O
+ *	started by a stage and completed asynchronously.
+ */
+void pipeline_set_error(struct pipeline *p, int error)
+{
+	set_error(p, error);
+}
+
+/**
+ *	pipeline_finish - wait until all of the submitted blocks have passed the
+ *			last stage
+ *
+ *	If the blocks are delivered, they need not have been received yet.
+ */
+int pipeline_finish(struct pipeline *p)
+{
+	wait_event(p, p->events + p->nr_stages, all_completed, p->submitted);
+	return pipeline_error(p);
+}
+
+/**
+ *	pipeline_error - return the error code of the first failing stage
+ */
+int pipeline_error(struct pipeline *p)
+{
+	int error = atomic_load(&p->error);
+
+	return error == STOPPED ? 0 : error;
+}
+
+/**
+ *	pipeline_stop - make the worker threads of a pipeline exit
+ */
+void pipeline_stop(struct pipeline *p)
+{
+#ifdef CONFIG_THREADS
+	int j;
+
+	set_error(p, STOPPED);
+	for (j = 0; j < p->nr_workers; j++)
+		pthread_join(p->workers[j].th, NULL);
+#endif
+	p->nr_workers = 0;
+}
+
+/**
+ *	pipeline_free - free the memory allocated by pipeline_init()
+ */
+void pipeline_free(struct pipeline *p)
+{
+	if (p->aux_buffers)
+		freemem(p->aux_buffers);
+	freemem(p->data_buffers);
+	freemem(p->blocks);
+}
@@ -0,0 +1,148 @@
+/*
+ * pipeline.h
+ *
+ * Definitions of the engine passing blocks of image data through a sequence
+ * of processing stages, possibly run by worker threads.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#ifdef CONFIG_THREADS
+#include <pthread.h>
+#endif
+
+/*
+ * A pipeline consists of up to PIPELINE_STAGES_MAX stages and a pool of
+ * blocks.  Blocks are numbered in the order in which they enter the pipeline
+ * and every stage takes them in that order, but a stage run by more than one
+ * worker thread may finish processing them out of order.  A stage with no
+ * worker threads of its own is run by the thread that has passed the block to
+ * it, so it gets the blocks in order only if that thread does.
+ *
+ * Blocks enter the pipeline either from the caller, which gets empty blocks
+ * with pipeline_get_block() and passes them on with pipeline_submit(), or
+ * from the first stage (a "source" stage), which fills empty blocks itself.
+ * After the last stage the blocks are either released, or delivered to the
+ * caller, in order, by pipeline_receive().
+ */
+
+#define PIPELINE_STAGES_MAX	8
+#define PIPELINE_WORKERS_MAX	32
+
+/* Returned by the process() callback of a source stage if there's no more data */
+#define PIPELINE_END	1
+
+/**
+ *	struct pipeline_block - block of data passed through a pipeline
+ *	@index:		Sequence number of the block.
+ *	@data:		Buffer holding the data (page-aligned).
+ *	@aux:		Scratch buffer of the same size, or NULL if not needed.
+ *	@size:		Number of bytes of data in @data.
+ *	@nr_pages:	Number of image data pages in the block.
+ *	@refcount:	The block returns to the pool when this drops to zero.
+ *	@stage:		The stage that is to process the block next.
+ *
+ *	Stages that don't transform the data in place put the result into @aux
+ *	and swap the buffers with pipeline_swap_buffers().
+ */
+struct pipeline_block {
+	unsigned long index;
+	void *data;
+	void *aux;
+	ssize_t size;
+	unsigned int nr_pages;
+	atomic_int refcount;
+	atomic_int stage;
+};
+
+/**
+ *	struct pipeline_stage - processing stage of a pipeline
+ *	@name:		Name of the stage.
+ *	@process:	Process the block, return 0 or a negative error code.
+ *			@worker is the number of the worker thread running the
+ *			stage (0 if it has no worker threads).
+ *	@data:		Passed to @process.
+ *	@workers:	Number of worker threads running the stage.
+ */
+struct pipeline_stage {
+	const char *name;
+	int (*process)(struct pipeline_block *block, int worker, void *data);
+	void *data;
+	int workers;
+};
+
+struct pipeline_event {
+	atomic_uint seq;
+	atomic_uint waiters;
+};
+
+struct pipeline;
+
+struct pipeline_worker {
+#ifdef CONFIG_THREADS
+	pthread_t th;
+#endif
+	struct pipeline *pipeline;
+	int stage;
+	int nr;
+};
+
+struct pipeline {
+	struct pipeline_stage stages[PIPELINE_STAGES_MAX];
+	int nr_stages;
+	char source;
+	char deliver;
+	struct pipeline_block *blocks;
+	unsigned int depth;
+	size_t block_size;
+	void *data_buffers;
+	void *aux_buffers;
+	atomic_int error;
+	unsigned long issued;
+	unsigned long submitted;
+	unsigned long received;
+	atomic_ulong completed;
+	atomic_ulong end;
+	atomic_ulong next[PIPELINE_STAGES_MAX];
+	/* One event per stage and one for blocks leaving the pipeline */
+	struct pipeline_event events[PIPELINE_STAGES_MAX + 1];
+	struct pipeline_worker workers[PIPELINE_WORKERS_MAX];
+	int nr_workers;
+};
+
+size_t pipeline_mem_size(unsigned int depth, size_t block_size, int aux);
+int pipeline_init(struct pipeline *p, unsigned int depth, size_t block_size,
+			int aux);
+void pipeline_add_stage(struct pipeline *p, const char *name,
+			int (*process)(struct pipeline_block *, int, void *),
+			void *data, int workers);
+int pipeline_start(struct pipeline *p, int source, int deliver);
+struct pipeline_block *pipeline_get_block(struct pipeline *p);
+int pipeline_submit(struct pipeline *p, struct pipeline_block *block);
+struct pipeline_block *pipeline_receive(struct pipeline *p);
+void pipeline_release(struct pipeline *p, struct pipeline_block *block);
+void pipeline_set_error(struct pipeline *p, int error);
+int pipeline_finish(struct pipeline *p);
+int pipeline_error(struct pipeline *p);
+void pipeline_stop(struct pipeline *p);
+void pipeline_free(struct pipeline *p);
+
+/*
+ * Take an additional reference to a block, e.g. if it is still used after
+ * the last stage has returned.  It has to be dropped with pipeline_release().
+ */
+static inline void pipeline_hold(struct pipeline_block *block)
+{
+	atomic_fetch_add(&block->refcount, 1);
+}
+
+static inline void pipeline_swap_buffers(struct pipeline_block *block)
+{
+	void *buf = block->data;
+
+	block->data = block->aux;
+	block->aux = buf;
+}
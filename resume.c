@@ -24,14 +24,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#ifdef CONFIG_COMPRESS
-#include <lzo/lzo1x.h>
-#endif
 
 #include "swsusp.h"
 #include "memalloc.h"
 #include "config_parser.h"
 #include "md5.h"
+#include "classify.h"
+#include "pipeline.h"
+#include "swap_io.h"
 #include "splash.h"
 #include "loglevel.h"
 
@@ -48,6 +48,9 @@ static char splash_param;
 char fbsplash_theme[MAX_STR_LEN] = "";
 #endif
 static int use_platform_suspend;
+#ifdef CONFIG_THREADS
+static char use_threads;
+#endif
 
 static struct config_par parameters[] = {
 	{
@@ -88,6 +91,35 @@ static struct config_par parameters[] = {
 		.ptr = NULL,
 	},
 #ifdef CONFIG_COMPRESS
+	{
+		.name = "compress method",
+		.fmt = "%s",
+		.ptr = NULL,
+	},
+	{
+		.name = "compress level max",
+		.fmt = "%d",
+		.ptr = NULL,
+	},
+	{
+		.name = "compress level",
+		.fmt = "%d",
+		.ptr = NULL,
+	},
+	{
+		.name = "compress threads",
+		.fmt = "%d",
+		.ptr = NULL,
+	},
+	{
+		.name = "decompress threads",
+		.fmt = "%d",
+#ifdef CONFIG_THREADS
+		.ptr = &decompress_threads,
+#else
+		.ptr = NULL,
+#endif
+	},
 	{
 		.name = "compress",
 		.fmt = "%c",
@@ -138,26 +170,39 @@ static struct config_par parameters[] = {
 	{
 		.name = "threads",
 		.fmt = "%c",
-		.ptr = NULL,
+		.ptr = &use_threads,
 	},
 #endif
 	{
-		.name = "debug test file",
-		.fmt = "%s",
+		.name = "swap io size",
+		.fmt = "%u",
+		.ptr = &swap_io_size,
+	},
+	{
+		.name = "swap io depth",
+		.fmt = "%u",
 		.ptr = NULL,
 	},
 	{
-		.name = "debug verify image",
+		.name = "writeout window",
+		.fmt = "%u",
+		.ptr = NULL,
+	},
+	{
+		.name = "direct io",
 		.fmt = "%c",
+		.ptr = &swap_io_direct,
+	},
+	{
+		.name = "debug test file",
+		.fmt = "%s",
 		.ptr = NULL,
 	},
-#ifdef CONFIG_THREADS
 	{
-		.name = "threads",
+		.name = "debug verify image",
 		.fmt = "%c",
 		.ptr = NULL,
 	},
-#endif
 	{
 		.name = NULL,
 		.fmt = NULL,
@@ -296,27 +341,18 @@ static int read_image(int dev, int fd, loff_t start)
 
 static int reset_signature(int fd, struct swsusp_header *swsusp_header)
 {
-	ssize_t ret, size = sizeof(struct swsusp_header);
+	ssize_t size = sizeof(struct swsusp_header);
 	off64_t shift = ((off64_t)resume_offset + 1) * page_size - size;
-	int error = 0;
+	int error;
 
 	/* Reset swap signature now */
 	memcpy(swsusp_header->sig, swsusp_header->orig_sig, 10);
 
-	if (lseek64(fd, shift, SEEK_SET) != shift) {
-		fprintf(stderr, "%s: Could not lseek() to the swap header",
-				my_name);
-		return -EIO;
-	}
-
-	ret = write(fd, swsusp_header, size);
-	if (ret == size) {
-		fsync(fd);
-	} else {
+	/* Nothing else has been written, so there's no need to flush */
+	error = swap_io_write_sync(fd, swsusp_header, size, shift);
+	if (error)
 		fprintf(stderr, "%s: Could not restore the swap header",
 				my_name);
-		error = -EIO;
-	}
 
 	return error;
 }
@@ -423,9 +459,23 @@ static inline int get_config(int argc, char *argv[])
 	return 0;
 }
 
+/**
+ *	threads_mem_size - memory needed for the read buffers and for the work
+ *			buffers of the "decode" threads other than the first one
+ */
+static unsigned int threads_mem_size(unsigned int buffers_size,
+					unsigned int work_size)
+{
+	unsigned int size = nr_read_buffers * buffers_size;
+
+	if (decompress_threads > 1)
+		size += (decompress_threads - 1) * work_size;
+	return size;
+}
+
 int main(int argc, char *argv[])
 {
-	unsigned int mem_size;
+	unsigned int mem_size, buffers_size, work_size = 0;
 	struct stat stat_buf;
 	int dev, resume_dev;
 	int n, error, orig_loglevel;
@@ -444,29 +494,73 @@ int main(int argc, char *argv[])
 	else
 		splash_param = SPL_RESUME;
 
+	swap_io_direct = swap_io_direct != 'n' && swap_io_direct != 'N';
+
+#ifdef CONFIG_THREADS
+	if (use_threads == 'y' || use_threads == 'Y') {
+		if (decompress_threads <= 0) {
+			/* Use as many "decode" threads as there are CPUs */
+			decompress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+			if (decompress_threads <= 0)
+				decompress_threads = 1;
+		}
+		if (decompress_threads > DECOMPRESS_THREADS_MAX)
+			decompress_threads = DECOMPRESS_THREADS_MAX;
+		/* Every "decode" thread needs a block to work on */
+		nr_read_buffers = READ_BUFFERS + decompress_threads - 1;
+	} else {
+		decompress_threads = 0;
+	}
+#endif
+
 	get_page_and_buffer_sizes();
 
-	mem_size = 2 * page_size + buffer_size;
+	mem_size = (2 + IMAGE_MAP_PAGES + IMAGE_INDEX_PAGES) * page_size;
 #ifdef CONFIG_ENCRYPT
 	printf("%s: libgcrypt version: %s\n", my_name,
 		gcry_check_version(NULL));
-	gcry_control(GCRYCTL_INIT_SECMEM, page_size, 0);
+	/* The "decode" threads may need cipher handles too */
+	gcry_control(GCRYCTL_INIT_SECMEM, (1 + decompress_threads) * page_size,
+			0);
 	mem_size += page_size;
 #endif
 #ifdef CONFIG_COMPRESS
 	/*
-	 * The formula below follows from the worst-case expansion calculation
-	 * for LZO1 (size / 16 + 67) and the fact that the size of the
-	 * compressed data must be stored in the buffer (sizeof(size_t)).
+	 * The compression method is not known until the image header has been
+	 * read, so use the worst case over all of the supported methods.  The
+	 * block header and checksum must also be stored in the buffer.
 	 */
-	compress_buf_size = buffer_size +
-			round_up_page_size((buffer_size >> 4) + 67 +
-						sizeof(size_t));
-	mem_size += compress_buf_size +
-			round_up_page_size(LZO1X_1_MEM_COMPRESS);
+	compress_buf_size = block_buffer_size(max_compressed_size(buffer_size));
+	/* The decompressed data go to the auxiliary buffers of the pipeline */
+	buffers_size = pipeline_mem_size(1, compress_buf_size, 1);
+	work_size = round_up_page_size(max_decompress_work_size());
+	mem_size += work_size;
+	/* Buffer for expanding page records */
+	mem_size += page_size;
+	/* Cache of pages referred to by page records */
+	mem_size += page_cache_size(0);
+#else
+	buffers_size = pipeline_mem_size(1, buffer_size, 0);
 #endif
 
-	error = init_memalloc(page_size, mem_size);
+	error = init_memalloc(mem_size +
+				threads_mem_size(buffers_size, work_size));
+#ifdef CONFIG_THREADS
+	while (error && decompress_threads > 1) {
+		/* Try with fewer "decode" threads */
+		decompress_threads /= 2;
+		nr_read_buffers = READ_BUFFERS + decompress_threads - 1;
+		error = init_memalloc(mem_size +
+				threads_mem_size(buffers_size, work_size));
+	}
+	if (error && nr_read_buffers > 1) {
+		/* Fall back to loading the image without threads */
+		fprintf(stderr, "%s: Not enough memory for threads\n", my_name);
+		nr_read_buffers = 1;
+		decompress_threads = 0;
+		error = init_memalloc(mem_size + buffers_size);
+	}
+#endif
 	if (error) {
 		fprintf(stderr, "%s: Could not allocate memory\n", my_name);
 		return error;
@@ -583,6 +677,7 @@ Free:
 
 	close_printk();
 
+	print_memalloc_stats();
 	free_memalloc();
 
 	return error;
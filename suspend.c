@@ -32,17 +32,16 @@
 #include <errno.h>
 #include <signal.h>
 #include <termios.h>
-#ifdef CONFIG_THREADS
-#include <pthread.h>
-#endif
-#ifdef CONFIG_COMPRESS
-#include <lzo/lzo1x.h>
-#endif
 
 #include "swsusp.h"
 #include "memalloc.h"
 #include "config_parser.h"
 #include "md5.h"
+#include "checksum.h"
+#include "classify.h"
+#include "pipeline.h"
+#include "swap_io.h"
+#include "extent_index.h"
 #include "splash.h"
 #include "vt.h"
 #include "loglevel.h"
@@ -74,19 +73,34 @@ static int suspend_loglevel = SUSPEND_LOGLEVEL;
 static char compute_checksum;
 #ifdef CONFIG_COMPRESS
 static char do_compress;
+static char compress_method[MAX_STR_LEN] = "lzo";
+static int compress_level;
+static int compress_level_max;
+static const struct compressor *compressor;
+static size_t compress_work_size;
+static char sparse_pages;
+static char dedup_pages;
+static char checksum_name[MAX_STR_LEN] = "md5";
+static const struct checksum_method *checksum;
+static char block_checksum;
 #else
 #define do_compress 0
+#define compress_work_size 0
+#define sparse_pages 0
+#define dedup_pages 0
+#define block_checksum 0
 #endif
 #ifdef CONFIG_ENCRYPT
 static char do_encrypt;
+static char encrypt_method[MAX_STR_LEN] = "blowfish";
+static char use_aes;
 static char use_RSA;
 static char key_name[MAX_STR_LEN] = SUSPEND_KEY_FILE_PATH;
 static char password[PASSBUF_SIZE];
-static unsigned long encrypt_buf_size;
 #else
 #define do_encrypt 0
+#define use_aes 0
 #define key_name NULL
-#define encrypt_buf_size 0
 #endif
 #ifdef CONFIG_BOTH
 static char s2ram;
@@ -108,8 +122,12 @@ static int resume_pause;
 static char verify_image;
 #ifdef CONFIG_THREADS
 static char use_threads;
+static int compress_threads;
+static int nr_write_buffers = WRITE_BUFFERS;
 #else
 #define use_threads	0
+#define compress_threads	0
+#define nr_write_buffers	WRITE_BUFFERS
 #endif
 
 static int suspend_swappiness = 0/* SUSPEND_SWAPPINESS */; //madhu 131212
@@ -155,13 +173,69 @@ static struct config_par parameters[] = {
 		.ptr = &compute_checksum,
 	},
 #ifdef CONFIG_COMPRESS
+	{
+		.name = "checksum method",
+		.fmt = "%s",
+		.ptr = checksum_name,
+		.len = MAX_STR_LEN,
+	},
+#endif
+#ifdef CONFIG_COMPRESS
+	/* These have to go before "compress" (prefix match) */
+	{
+		.name = "compress method",
+		.fmt = "%s",
+		.ptr = compress_method,
+		.len = MAX_STR_LEN,
+	},
+	{
+		.name = "compress level max",
+		.fmt = "%d",
+		.ptr = &compress_level_max,
+	},
+	{
+		.name = "compress level",
+		.fmt = "%d",
+		.ptr = &compress_level,
+	},
+	{
+		.name = "compress threads",
+		.fmt = "%d",
+#ifdef CONFIG_THREADS
+		.ptr = &compress_threads,
+#else
+		.ptr = NULL,
+#endif
+	},
+	{
+		.name = "decompress threads",
+		.fmt = "%d",
+		.ptr = NULL,
+	},
 	{
 		.name = "compress",
 		.fmt = "%c",
 		.ptr = &do_compress,
 	},
+	{
+		.name = "eliminate zero pages",
+		.fmt = "%c",
+		.ptr = &sparse_pages,
+	},
+	{
+		.name = "eliminate duplicate pages",
+		.fmt = "%c",
+		.ptr = &dedup_pages,
+	},
 #endif
 #ifdef CONFIG_ENCRYPT
+	/* This has to go before "encrypt" (prefix match) */
+	{
+		.name = "encrypt method",
+		.fmt = "%s",
+		.ptr = encrypt_method,
+		.len = MAX_STR_LEN,
+	},
 	{
 		.name = "encrypt",
 		.fmt = "%c",
@@ -221,6 +295,26 @@ static struct config_par parameters[] = {
 		.ptr = &use_threads,
 	},
 #endif
+	{
+		.name = "swap io size",
+		.fmt = "%u",
+		.ptr = &swap_io_size,
+	},
+	{
+		.name = "swap io depth",
+		.fmt = "%u",
+		.ptr = &swap_io_depth,
+	},
+	{
+		.name = "writeout window",
+		.fmt = "%u",
+		.ptr = &swap_writeout_window,
+	},
+	{
+		.name = "direct io",
+		.fmt = "%c",
+		.ptr = &swap_io_direct,
+	},
 	{
 		.name = NULL,
 		.fmt = NULL,
@@ -257,12 +351,35 @@ static loff_t get_image_size(int dev)
 	return 0;
 }
 
+/* Longest time to wait for the snapshot device to become available, in ns */
+#define SWAP_BUSY_DELAY_MAX	1000000
+/* Give up allocating a swap page if the device stays busy that long, in ms */
+#define SWAP_BUSY_TIMEOUT	10000
+
+/*
+ * The snapshot device refuses ioctls with EBUSY while another thread is
+ * reading from it, which may happen if swap is allocated by a separate thread.
+ * The reader may hold the device for a while, so back off exponentially
+ * instead of spinning on it, but fail if it doesn't let go of it.
+ */
 static inline loff_t get_swap_page(int dev)
 {
+	struct timespec delay = { 0, 1000 };
+	unsigned long waited = 0; /* in us */
 	int error;
 	loff_t offset;
 
-	error = ioctl(dev, SNAPSHOT_ALLOC_SWAP_PAGE, &offset);
+	while ((error = ioctl(dev, SNAPSHOT_ALLOC_SWAP_PAGE, &offset)) &&
+	    errno == EBUSY) {
+		if (waited / 1000 >= SWAP_BUSY_TIMEOUT) {
+			suspend_warning("The snapshot device stays busy.");
+			return 0;
+		}
+		nanosleep(&delay, NULL);
+		waited += delay.tv_nsec / 1000;
+		if (delay.tv_nsec < SWAP_BUSY_DELAY_MAX)
+			delay.tv_nsec *= 2;
+	}
 	if (error && errno == ENOTTY)
 		error = ioctl(dev, SNAPSHOT_GET_SWAP_PAGE, &offset);
 	if (!error)
@@ -341,128 +458,37 @@ static int platform_enter(int dev)
 /**
  *	alloc_swap - allocate a number of swap pages
  *	@dev:		Swap device to use for allocations.
- *	@extents:	Array of extents to track the allocations.
- *	@nr_extents:	Number of extents already in the array.
+ *	@index:		Index of extents to track the allocations.
  *	@size_p:	Points to the number of bytes to allocate, used to
  *			return the number of allocated bytes.
  *
  *	Allocate the number of swap pages sufficient for saving the number of
- *	bytes pointed to by @size_p.  Use the array @extents to track the
- *	allocations.  This array has to be page_size big and may already
- *	contain some initial elements (in that case @nr_extents must be the
- *	number of these elements).
- *	Each element of the array represents an area of allocated swap space.
- *	These areas may be extended when swap pages that can be added to them
- *	are found.  They also can be merged with one another.
+ *	bytes pointed to by @size_p.  Use @index to track the allocations.
+ *	Each extent in the index represents an area of allocated swap space.
+ *	These areas are extended when swap pages that can be added to them
+ *	are found and merged with one another when the gaps between them are
+ *	filled.
  *	The function returns when the requested amount of swap space is
- *	allocated or if there is no room for more extents.  In the latter case
- *	the last extent created is put at the end of the array and may be passed
- *	to alloc_swap() as the initial extent when it is invoked next time.
+ *	allocated or if there may be no room in @index for another extent.
+ *	Returns the number of extents in @index.
  */
 static int
-alloc_swap(int dev, struct extent *extents, int nr_extents, loff_t *size_p)
+alloc_swap(int dev, struct extent_index *index, loff_t *size_p)
 {
-	const int max_extents = page_size / sizeof(struct extent) - 1;
-	loff_t size, total_size, offset;
-
-	total_size = *size_p;
-	if (nr_extents <= 0) {
-		offset = get_swap_page(dev);
-		if (!offset)
-			return -ENOSPC;
-		extents->start = offset;
-		extents->end = offset + page_size;
-		nr_extents = 1;
-		size = page_size;
-	} else {
-		size = 0;
-	}
-	while (size < total_size && nr_extents <= max_extents) {
-		int i, j;
+	loff_t size, offset;
+	int error;
 
+	for (size = 0; size < *size_p && !extent_index_full(index);
+	     size += page_size) {
 		offset = get_swap_page(dev);
 		if (!offset)
 			return -ENOSPC;
-		/* Check if we have a matching extent. */
-		i = 0;
-		j = nr_extents - 1;
-		do {
-			struct extent *ext;
-			int k = (i + j) / 2;
-
- Repeat:
-			ext = extents + k;
-			if (offset == ext->start - page_size) {
-				ext->start = offset;
-				/* Check if we can merge extents */
-				if (k > 0 && extents[k-1].end == offset) {
-					extents[k-1].end = ext->end;
-					/* Pull the 'later' extents forward */
-					memmove(ext, ext + 1,
-						(nr_extents - k - 1) *
-							sizeof(*ext));
-					nr_extents--;
-				}
-				offset = 0;
-				break;
-			} else if (offset == ext->end) {
-				ext->end += page_size;
-				/* Check if we can merge extents */
-				if (k + 1 < nr_extents
-				    && ext->end == extents[k+1].start) {
-					ext->end = extents[k+1].end;
-					/* Pull the 'later' extents forward */
-					memmove(ext + 1, ext + 2,
-						(nr_extents - k - 2) *
-							sizeof(*ext));
-					nr_extents--;
-				}
-				offset = 0;
-				break;
-			} else if (offset > ext->end) {
-				if (i == k) {
-					if (i < j) {
-						/* This means i == j + 1 */
-						k = j;
-						i = j;
-						goto Repeat;
-					}
-				} else {
-					i = k;
-				}
-			} else {
-				/* offset < ext->start - page_size */
-				j = k;
-			}
-		} while (i < j);
-		if (offset > 0) {
-			/* No match.  Create a new extent. */
-			struct extent *ext;
-
-			if (nr_extents < max_extents) {
-				ext = extents + i;
-				/*
-				 * We want to always replace the extent 'i' with
-				 * the new one.
-				 */
-				if (offset > ext->end) {
-					i++;
-					ext++;
-				}
-				/* Push the 'later' extents backwards. */
-				memmove(ext + 1, ext,
-					(nr_extents - i) * sizeof(*ext));
-			} else {
-				ext = extents + nr_extents;
-			}
-			ext->start = offset;
-			ext->end = offset + page_size;
-			nr_extents++;
-		}
-		size += page_size;
+		error = extent_index_add(index, offset);
+		if (error)
+			return error;
 	}
 	*size_p = size;
-	return nr_extents;
+	return index->nr_extents;
 }
 
 /**
@@ -486,14 +512,73 @@ static int write_page(int fd, void *buf, loff_t offset)
 	return res;
 }
 
+/* Number of batches of swap allocations that can be prepared in advance */
+#define SWAP_BATCHES	4
+/* Minimum amount of swap to allocate in one batch */
+#define SWAP_BATCH_SIZE	(8 << 20)
+/* Maximum number of extents pages one batch can fill */
+#define SWAP_BATCH_PAGES	8
+
+/**
+ *	struct swap_batch - batch of swap allocations
+ *	@index:		Extents allocated with alloc_swap().  It can hold
+ *			SWAP_BATCH_PAGES pages worth of them.
+ *	@extents_spc:	The swap pages to which to save the extents.
+ *	@nr_pages:	Number of entries in @extents_spc actually used.
+ */
+struct swap_batch {
+	struct extent_index index;
+	loff_t extents_spc[SWAP_BATCH_PAGES];
+	int nr_pages;
+};
+
+/**
+ *	struct swap_allocator - source of batches of swap allocations
+ *	@batches:	Ring of batches.  The ones from @tail up to @head are
+ *			ready to be used.
+ *	@head:		Number of batches prepared so far.
+ *	@tail:		Number of batches used so far.
+ *	@left:		The amount of swap that still may be needed.
+ *	@batch_size:	The amount of swap to allocate in one batch.
+ *	@nr_pages:	Number of swap pages allocated.
+ *	@alloc_time:	Time spent allocating swap pages.
+ *	@wait_time:	Time the writer has spent waiting for the allocator.
+ *	@thread:	Thread preparing batches in the background.
+ *	@running:	Set if @thread has been started.
+ *	@done:		Set by @thread if it can't prepare any more batches.
+ *	@stop:		Tells @thread to exit.
+ *	@lock:		Protects @done and @stop.
+ *
+ *	If @thread is running, it is the only one to prepare batches and the
+ *	writer is the only one to use them, so the ring doesn't need a lock.
+ *	Otherwise the writer prepares batches itself when it needs them.
+ */
+struct swap_allocator {
+	struct swap_batch batches[SWAP_BATCHES];
+	atomic_uint head;
+	atomic_uint tail;
+	loff_t left;
+	loff_t batch_size;
+	unsigned long nr_pages;
+	struct timeval alloc_time;
+	struct timeval wait_time;
+#ifdef CONFIG_THREADS
+	pthread_t thread;
+	char running;
+	char done;
+	char stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
 /*
  * The swap_writer structure is used for handling swap in a file-alike way.
  *
  * @extents:	Array of extents used for trackig swap allocations.  It is
  *		page_size bytes large and holds at most
  *		(page_size / sizeof(struct extent) - 1) extents.  The last slot
- *		is used to hold the extent that will be used as an initial one
- *		for the next batch of allocations.
+ *		is used to store the swap offset of the next extents page.
  *
  * @nr_extents:		Number of entries in @extents actually used.
  *
@@ -509,11 +594,48 @@ static int write_page(int fd, void *buf, loff_t offset)
  *
  * @extents_spc:	The swap page to which to save @extents.
  *
- * @buffer:		Buffer used for storing image data pages.
+ * @alloc:		Source of batches of swap allocations replacing
+ *			@extents when they are exhausted.
+ *
+ * @batch:		Batch the next extents are taken from, or NULL if all of
+ *			its extents have been moved to @extents already.
+ *
+ * @next_node:		Node of @batch->index holding the next extent to take.
+ *
+ * @batch_page:		Index of the entry in @batch->extents_spc to save the
+ *			next extents page to.
+ *
+ * @map:		Extent map of the image (IMAGE_MAP_PAGES pages), built
+ *			as the extents pages are saved.
  *
- * @write_buffer:	If compression is used, the compressed contents of
- *			@buffer are stored here.  Otherwise, it is equal to
- *			@buffer.
+ * @map_size:		Number of bytes in @map.
+ *
+ * @map_end:		End of the last extent in @map.
+ *
+ * @map_overflow:	Set if the extents didn't fit into @map.
+ *
+ * @map_pages:		Swap pages @map has been saved to.
+ *
+ * @index:		Block index of the image (IMAGE_INDEX_PAGES pages), or
+ *			NULL if the image is not compressed.
+ *
+ * @index_size:		Number of bytes in @index.
+ *
+ * @index_overflow:	Set if the blocks didn't fit into @index.
+ *
+ * @index_pages:	Swap pages @index has been saved to.
+ *
+ * @block_pages:	Number of image data pages in @block.
+ *
+ * @pipeline:		Pipeline saving blocks of image data (see
+ *			setup_pipeline()).
+ *
+ * @block:		Block of the pipeline to put image data pages into.
+ *
+ * @buffer:		Data buffer of @block, which image data pages are read
+ *			into directly.  It is owned by the pipeline from the
+ *			submission of @block until the block is returned by
+ *			pipeline_get_block() again.
  *
  * @page_ptr:		Address to write the next image page to.
  *
@@ -522,13 +644,22 @@ static int write_page(int fd, void *buf, loff_t offset)
  *
  * @fd:			File handle associated with the swap.
  *
- * @ctx:		Used for checksum computing, if so configured.
+ * @io:			Batch of image data pages to be written to the swap.
  *
- * @lzo_work_buffer:	Work buffer used for compression.
+ * @ring:		io_uring instance used for writing image data, if
+ *			@io.ring points to it.
  *
- * @encrypt_buffer:	Buffer for storing encrypted data (page_size bytes).
+ * @writeout:		Window of image data being written back early, if
+ *			@io.writeout points to it.
  *
- * @encrypt_ptr:	Address to store the next encrypted page at.
+ * @image_checksum:	Set if the MD5 checksum of the image is computed.
+ *
+ * @ctx:		Used for checksum computing, if so configured.
+ *
+ * @compress_work_buffer:	Work buffer used for compression (one per
+ *			compression thread, if these are used).
+ *
+ * @page_cache:		Used for finding duplicate pages, if so configured.
  */
 struct swap_writer {
 	struct extent *extents;
@@ -539,14 +670,34 @@ struct swap_writer {
 	loff_t swap_needed;
 	loff_t written_data;
 	loff_t extents_spc;
+	struct swap_allocator alloc;
+	struct swap_batch *batch;
+	int next_node;
+	int batch_page;
+	unsigned char *map;
+	size_t map_size;
+	loff_t map_end;
+	char map_overflow;
+	loff_t map_pages[IMAGE_MAP_PAGES];
+	unsigned char *index;
+	size_t index_size;
+	char index_overflow;
+	loff_t index_pages[IMAGE_INDEX_PAGES];
+	unsigned int block_pages;
+	struct pipeline pipeline;
+	struct pipeline_block *block;
 	void *buffer;
-	void *write_buffer;
 	void *page_ptr;
 	int dev, fd, input;
+	struct swap_io io;
+#ifdef CONFIG_IO_URING
+	struct swap_ring ring;
+#endif
+	struct swap_writeout writeout;
+	char image_checksum;
 	struct md5_ctx ctx;
-	void *lzo_work_buffer;
-	void *encrypt_buffer;
-	void *encrypt_ptr;
+	void *compress_work_buffer;
+	struct page_cache page_cache;
 };
 
 /**
@@ -555,16 +706,64 @@ struct swap_writer {
  */
 static void free_swap_writer(struct swap_writer *handle)
 {
-	if (handle->write_buffer != handle->buffer)
-		freemem(handle->write_buffer);
+	int j;
+
+	if (handle->page_cache.pages)
+		free_page_cache(&handle->page_cache);
 	if (do_compress)
-		freemem(handle->lzo_work_buffer);
-	if (handle->encrypt_buffer)
-		freemem(handle->encrypt_buffer);
-	freemem(handle->buffer);
+		freemem(handle->compress_work_buffer);
+	pipeline_free(&handle->pipeline);
+	for (j = SWAP_BATCHES - 1; j >= 0; j--)
+		extent_index_free(&handle->alloc.batches[j].index);
+	if (handle->index)
+		freemem(handle->index);
+	freemem(handle->map);
 	freemem(handle->extents);
 }
 
+/**
+ *	next_block - get an empty block of the pipeline to put image data into
+ */
+static int next_block(struct swap_writer *handle)
+{
+	handle->block = pipeline_get_block(&handle->pipeline);
+	if (!handle->block) {
+		int error = pipeline_error(&handle->pipeline);
+
+		return error ? error : -EIO;
+	}
+	handle->buffer = handle->block->data;
+	handle->page_ptr = handle->buffer;
+	handle->block_pages = 0;
+	return 0;
+}
+
+/**
+ *	swap_writer_mem_size - memory needed for saving the image
+ *
+ *	This goes through the allocations made by init_swap_writer() and by
+ *	write_image() after it, so it has to be kept in sync with them.
+ */
+static size_t swap_writer_mem_size(void)
+{
+	const int max = page_size / sizeof(struct extent) - 1;
+	size_t size;
+
+	size = page_size + IMAGE_MAP_PAGES * page_size;
+	if (do_compress)
+		size += IMAGE_INDEX_PAGES * page_size;
+	size += SWAP_BATCHES * extent_index_mem_size(SWAP_BATCH_PAGES * max);
+	size += pipeline_mem_size(use_threads ? nr_write_buffers : 1,
+			do_compress ? compress_buf_size : buffer_size,
+			do_compress);
+	if (do_compress)
+		size += (compress_threads > 0 ? compress_threads : 1) *
+				compress_work_size;
+	if (dedup_pages)
+		size += page_cache_size(1);
+	return size;
+}
+
 /**
  *	init_swap_writer - initialize the structure used for saving the image
  *	@handle:	Structure to initialize.
@@ -576,117 +775,375 @@ static void free_swap_writer(struct swap_writer *handle)
  */
 static int init_swap_writer(struct swap_writer *handle, int dev, int fd, int in)
 {
-	loff_t offset;
-	unsigned int write_buf_size = 0;
+	const int max = page_size / sizeof(struct extent) - 1;
+	struct swap_allocator *a = &handle->alloc;
+	int error = 0, j;
 
 	handle->extents = getmem(page_size);
-
-	handle->buffer = getmem(buffer_size);
-	handle->page_ptr = handle->buffer;
-
-	if (do_encrypt) {
-		handle->encrypt_buffer = getmem(encrypt_buf_size);
-		handle->encrypt_ptr = handle->encrypt_buffer;
-	} else {
-		handle->encrypt_buffer = NULL;
+	handle->map = getmem(IMAGE_MAP_PAGES * page_size);
+	handle->index = do_compress ?
+			getmem(IMAGE_INDEX_PAGES * page_size) : NULL;
+	if (!handle->extents || !handle->map || (do_compress && !handle->index))
+		error = -ENOMEM;
+	for (j = 0; j < SWAP_BATCHES && !error; j++)
+		error = extent_index_init(&a->batches[j].index,
+						SWAP_BATCH_PAGES * max);
+	if (!error)
+		error = pipeline_init(&handle->pipeline,
+				use_threads ? nr_write_buffers : 1,
+				do_compress ? compress_buf_size : buffer_size,
+				do_compress);
+	if (!error && do_compress) {
+		handle->compress_work_buffer = getmem(compress_threads > 0 ?
+			compress_threads * compress_work_size :
+			compress_work_size);
+		if (!handle->compress_work_buffer) {
+			pipeline_free(&handle->pipeline);
+			error = -ENOMEM;
+		}
 	}
-
-	if (do_compress) {
-		handle->lzo_work_buffer = getmem(LZO1X_1_MEM_COMPRESS);
-		write_buf_size = compress_buf_size;
-		if (use_threads)
-			write_buf_size +=
-				(WRITE_BUFFERS - 1) * compress_buf_size;
+	if (error) {
+		while (--j >= 0)
+			extent_index_free(&a->batches[j].index);
+		if (handle->index)
+			freemem(handle->index);
+		freemem(handle->map);
+		freemem(handle->extents);
+		return error;
 	}
-
-	if (write_buf_size > 0)
-		handle->write_buffer = getmem(write_buf_size);
-	else if (use_threads)
-		handle->write_buffer = getmem(buffer_size * WRITE_BUFFERS);
-	else
-		handle->write_buffer = handle->buffer;
+	handle->page_cache.pages = NULL;
 
 	handle->dev = dev;
 	handle->fd = fd;
+	swap_io_init(&handle->io, fd, 1);
 	handle->input = (in >= 0) ? in : dev;
 	handle->written_data = 0;
 
 	memset(handle->extents, 0, page_size);
 	handle->nr_extents = 0;
-	offset = get_swap_page(dev);
-	if (!offset) {
+	atomic_store(&a->head, 0);
+	atomic_store(&a->tail, 0);
+	handle->batch = NULL;
+	handle->map_size = 0;
+	handle->map_end = 0;
+	handle->map_overflow = 0;
+	handle->index_size = 0;
+	handle->index_overflow = 0;
+	a->nr_pages = 0;
+	timerclear(&a->alloc_time);
+	timerclear(&a->wait_time);
+#ifdef CONFIG_THREADS
+	a->running = 0;
+#endif
+
+	handle->image_checksum = (compute_checksum || verify_image) &&
+					!block_checksum;
+	if (handle->image_checksum)
+		md5_init_ctx(&handle->ctx);
+
+	/* The first page may be read before the pipeline is started */
+	error = next_block(handle);
+	if (error)
 		free_swap_writer(handle);
+	return error;
+}
+
+/**
+ *	prepare_batch - allocate swap for the next batch in the allocator's ring
+ *	@handle:	Structure containing the allocator.
+ *
+ *	There must be a free slot in the ring.  The batch becomes available to
+ *	take_batch() when this returns 0.
+ */
+static int prepare_batch(struct swap_writer *handle)
+{
+	const int max = page_size / sizeof(struct extent) - 1;
+	struct swap_allocator *a = &handle->alloc;
+	unsigned int head = atomic_load(&a->head);
+	struct swap_batch *batch = a->batches + head % SWAP_BATCHES;
+	struct timeval begin, end;
+	loff_t size;
+	int nr_extents, j;
+
+	if (a->left < page_size)
 		return -ENOSPC;
+
+	gettimeofday(&begin, NULL);
+	extent_index_clear(&batch->index);
+	size = a->left < a->batch_size ? a->left : a->batch_size;
+	nr_extents = alloc_swap(handle->dev, &batch->index, &size);
+	if (nr_extents <= 0)
+		return -ENOSPC;
+	/* The extents are saved only after the batch has been allocated */
+	batch->nr_pages = (nr_extents + max - 1) / max;
+	for (j = 0; j < batch->nr_pages; j++) {
+		batch->extents_spc[j] = get_swap_page(handle->dev);
+		if (!batch->extents_spc[j])
+			return -ENOSPC;
 	}
-	handle->extents_spc = offset;
+	gettimeofday(&end, NULL);
+	timersub(&end, &begin, &end);
+	timeradd(&a->alloc_time, &end, &a->alloc_time);
+	a->nr_pages += size / page_size + batch->nr_pages;
+	a->left -= size;
 
-	if (compute_checksum || verify_image)
-		md5_init_ctx(&handle->ctx);
+	atomic_store(&a->head, head + 1);
+	return 0;
+}
+
+#ifdef CONFIG_THREADS
+/**
+ *	swap_allocator_thread - keep the allocator's ring of batches full
+ *
+ *	Swap pages are allocated one at a time, so doing that in the writer
+ *	would stall the pipeline whenever a batch is exhausted.
+ */
+static void *swap_allocator_thread(void *data)
+{
+	struct swap_writer *handle = data;
+	struct swap_allocator *a = &handle->alloc;
+	int error;
+
+	pthread_mutex_lock(&a->lock);
+	while (!a->stop && !a->done) {
+		if (atomic_load(&a->head) - atomic_load(&a->tail) >=
+							SWAP_BATCHES) {
+			pthread_cond_wait(&a->cond, &a->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&a->lock);
+		error = prepare_batch(handle);
+		pthread_mutex_lock(&a->lock);
+		if (error)
+			a->done = 1;
+		pthread_cond_broadcast(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+/**
+ *	start_swap_allocator - start preparing batches in the background
+ *
+ *	If the thread cannot be started, the writer goes on preparing batches
+ *	by itself.
+ */
+static void start_swap_allocator(struct swap_writer *handle)
+{
+	struct swap_allocator *a = &handle->alloc;
+
+	a->done = 0;
+	a->stop = 0;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	a->running = 1;
+	if (pthread_create(&a->thread, NULL, swap_allocator_thread, handle)) {
+		a->running = 0;
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->lock);
+	}
+}
 
+/**
+ *	stop_swap_allocator - make the writer prepare batches by itself again
+ *
+ *	Does nothing if the thread is not running.
+ */
+static void stop_swap_allocator(struct swap_writer *handle)
+{
+	struct swap_allocator *a = &handle->alloc;
+
+	if (!a->running)
+		return;
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+	pthread_join(a->thread, NULL);
+	a->running = 0;
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+}
+#endif
+
+/**
+ *	take_batch - get the oldest prepared batch of swap allocations
+ *
+ *	Returns NULL if there's no more swap to allocate.  The batch stays in
+ *	the ring until put_batch() is called for it.
+ */
+static struct swap_batch *take_batch(struct swap_writer *handle)
+{
+	struct swap_allocator *a = &handle->alloc;
+	unsigned int tail = atomic_load(&a->tail);
+
+	if (atomic_load(&a->head) != tail)
+		return a->batches + tail % SWAP_BATCHES;
+
+#ifdef CONFIG_THREADS
+	if (a->running) {
+		struct timeval begin, end;
+
+		gettimeofday(&begin, NULL);
+		pthread_mutex_lock(&a->lock);
+		while (atomic_load(&a->head) == tail && !a->done)
+			pthread_cond_wait(&a->cond, &a->lock);
+		pthread_mutex_unlock(&a->lock);
+		gettimeofday(&end, NULL);
+		timersub(&end, &begin, &end);
+		timeradd(&a->wait_time, &end, &a->wait_time);
+		if (atomic_load(&a->head) == tail)
+			return NULL;
+		return a->batches + tail % SWAP_BATCHES;
+	}
+#endif
+	if (prepare_batch(handle))
+		return NULL;
+	return a->batches + tail % SWAP_BATCHES;
+}
+
+/**
+ *	put_batch - return the oldest batch to the ring after it has been used
+ */
+static void put_batch(struct swap_writer *handle)
+{
+	struct swap_allocator *a = &handle->alloc;
+
+	atomic_fetch_add(&a->tail, 1);
+#ifdef CONFIG_THREADS
+	if (a->running) {
+		pthread_mutex_lock(&a->lock);
+		pthread_cond_signal(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+	}
+#endif
+}
+
+/**
+ *	next_batch - make the writer take extents from the next batch
+ */
+static int next_batch(struct swap_writer *handle)
+{
+	handle->batch = take_batch(handle);
+	if (!handle->batch)
+		return -ENOSPC;
+	handle->next_node = extent_index_first(&handle->batch->index);
+	handle->batch_page = 0;
 	return 0;
 }
 
 /**
- *	preallocate_swap - use alloc_swap() to preallocate the number of pages
- *			given by @handle->swap_needed
- *	@handle:	Pointer to the structure in which to store information
- *			about the preallocated swap pool.
+ *	fill_extents - move the next extents of @handle->batch to
+ *			@handle->extents
  *
- *	Returns the offset of the first swap page available from the
- *	preallocated pool.
+ *	The batch is put back into the ring after its last extent has been
+ *	taken.  Returns the offset of the first swap page available from the
+ *	new extents.
  */
-static loff_t preallocate_swap(struct swap_writer *handle)
+static loff_t fill_extents(struct swap_writer *handle)
 {
 	const int max = page_size / sizeof(struct extent) - 1;
-	loff_t size;
-	int nr_extents;
+	struct swap_batch *batch = handle->batch;
+	int i = handle->next_node, n = 0;
 
-	if (handle->swap_needed < page_size)
-		return 0;
-	size = handle->swap_needed;
-	if (do_compress && size > page_size)
-		size /= 2;
-	nr_extents = alloc_swap(handle->dev, handle->extents,
-					handle->nr_extents, &size);
-	if (nr_extents <= 0)
-		return 0;
-	handle->nr_extents = nr_extents < max ? nr_extents : max;
+	memset(handle->extents, 0, page_size);
+	for (; i && n < max; i = extent_index_next(&batch->index, i))
+		handle->extents[n++] = *extent_index_get(&batch->index, i);
+	handle->extents_spc = batch->extents_spc[handle->batch_page++];
+	handle->next_node = i;
+	if (!i) {
+		handle->batch = NULL;
+		put_batch(handle);
+	}
+	handle->nr_extents = n;
 	handle->cur_extent = handle->extents;
 	handle->cur_extent_idx = 0;
 	handle->cur_offset = handle->cur_extent->start;
 	return handle->cur_offset;
 }
 
+/**
+ *	preallocate_swap - get the first batch of swap allocations
+ *	@handle:	Pointer to the structure in which to store information
+ *			about the preallocated swap pool.
+ *
+ *	At most @handle->swap_needed bytes of swap are allocated in total, in
+ *	batches big enough for the data the pipeline may hold at a time.
+ *
+ *	Returns the offset of the first swap page available from the
+ *	preallocated pool.
+ */
+static loff_t preallocate_swap(struct swap_writer *handle)
+{
+	struct swap_allocator *a = &handle->alloc;
+
+	a->left = handle->swap_needed;
+	a->batch_size = 2 * (use_threads ? nr_write_buffers : 1) *
+			(do_compress ? compress_buf_size : buffer_size);
+	if (a->batch_size < SWAP_BATCH_SIZE)
+		a->batch_size = SWAP_BATCH_SIZE;
+	if (next_batch(handle))
+		return 0;
+	return fill_extents(handle);
+}
+
 /**
  *	save_extents - save the array of extents
  *	handle:	Structure holding the pointer to the array of extents etc.
- *	finish:	If set, the last element of the extents array has to be filled
- *		with zeros.
+ *	next:	Swap offset of the next extents page, or 0 if this is the last
+ *		one.
  *
  *	Save the buffer (page) holding the array of extents to the swap
- *	location pointed to by @handle->extents_spc (this must be allocated
- *	earlier).  Before saving the last element of the array is used to store
- *	the swap offset of the next extents page (we allocate a swap page for
- *	this purpose).
+ *	location pointed to by @handle->extents_spc.  Before saving the last
+ *	element of the array is used to store @next.  The extents are also
+ *	appended to @handle->map.
  */
-static int save_extents(struct swap_writer *handle, int finish)
+static int save_extents(struct swap_writer *handle, loff_t next)
 {
-	loff_t offset = 0;
-	int error;
+	struct extent *last_extent;
+	int j;
 
-	if (!finish) {
-		struct extent *last_extent;
+	for (j = 0; j < handle->nr_extents && !handle->map_overflow; j++) {
+		if (handle->map_size + EXTENT_MAP_MAX >
+					IMAGE_MAP_PAGES * page_size) {
+			handle->map_overflow = 1;
+			break;
+		}
+		handle->map_size += extent_map_put(
+				handle->map + handle->map_size,
+				&handle->map_end, handle->extents + j);
+	}
+	last_extent = handle->extents + page_size / sizeof(struct extent) - 1;
+	last_extent->start = next;
+	return write_page(handle->fd, handle->extents, handle->extents_spc);
+}
 
-		offset = get_swap_page(handle->dev);
-		if (!offset)
-			return -ENOSPC;
-		last_extent = handle->extents +
-				page_size / sizeof(struct extent) - 1;
-		last_extent->start = offset;
+/**
+ *	save_metadata - save the extent map or the block index after the image
+ *	@handle:	Structure holding the swap writer.
+ *	@buf:		Data to save.
+ *	@size_p:	Points to the number of bytes in @buf.
+ *	@pages:		Where to store the swap offsets of the pages used.
+ *
+ *	The extent map and the block index are only additions to the image,
+ *	so it can do without them if there is not enough swap to save them.
+ *	In that case *@size_p is set to 0.
+ */
+static void save_metadata(struct swap_writer *handle, unsigned char *buf,
+				size_t *size_p, loff_t *pages)
+{
+	unsigned int n, j;
+
+	n = (*size_p + page_size - 1) / page_size;
+	memset(buf + *size_p, 0, n * page_size - *size_p);
+	for (j = 0; j < n; j++) {
+		pages[j] = get_swap_page(handle->dev);
+		if (!pages[j] ||
+		    write_page(handle->fd, buf + j * page_size, pages[j])) {
+			*size_p = 0;
+			return;
+		}
 	}
-	error = write_page(handle->fd, handle->extents, handle->extents_spc);
-	handle->extents_spc = offset;
-	return error;
 }
 
 /**
@@ -697,8 +1154,6 @@ static int save_extents(struct swap_writer *handle, int finish)
  */
 static loff_t next_swap_page(struct swap_writer *handle)
 {
-	struct extent ext;
-
 	handle->cur_offset += page_size;
 	if (handle->cur_offset < handle->cur_extent->end)
 		return handle->cur_offset;
@@ -709,20 +1164,13 @@ static loff_t next_swap_page(struct swap_writer *handle)
 		handle->cur_offset = handle->cur_extent->start;
 		return handle->cur_offset;
 	}
-	/* No more extents.  Is there anything to pass to alloc_swap()? */
-	if (handle->cur_extent->start < handle->cur_extent->end) {
-		ext = *handle->cur_extent;
-		memset(handle->cur_extent, 0, sizeof(struct extent));
-		handle->nr_extents = 1;
-	} else {
-		memset(&ext, 0, sizeof(struct extent));
-		handle->nr_extents = 0;
-	}
-	if (save_extents(handle, 0))
+	/* No more extents.  Save them and take the next ones */
+	if (!handle->batch && next_batch(handle))
 		return 0;
-	memset(handle->extents, 0, page_size);
-	*handle->extents = ext;
-	return preallocate_swap(handle);
+	if (save_extents(handle,
+			handle->batch->extents_spc[handle->batch_page]))
+		return 0;
+	return fill_extents(handle);
 }
 
 /**
@@ -730,6 +1178,9 @@ static loff_t next_swap_page(struct swap_writer *handle)
  *	@handle:	Pointer to the structure containing information about
  *			the swap.
  *	@src:		Pointer to the data.
+ *
+ *	The page is only added to @handle->io, so @src must not be modified
+ *	until that has been flushed.
  */
 static int save_page(struct swap_writer *handle, void *src)
 {
@@ -739,7 +1190,7 @@ static int save_page(struct swap_writer *handle, void *src)
 	offset = next_swap_page(handle);
 	if (!offset)
 		return -ENOSPC;
-	error = write_page(handle->fd, src, offset);
+	error = swap_io_add(&handle->io, src, offset);
 	if (error)
 		return error;
 	handle->swap_needed -= page_size;
@@ -747,457 +1198,652 @@ static int save_page(struct swap_writer *handle, void *src)
 	return 0;
 }
 
-#ifdef CONFIG_THREADS
+/**
+ *	compress_buffer - compress a buffer of image data pages
+ *	@buf:		Data to compress.
+ *	@size:		Number of bytes to compress.
+ *	@block:		Block to store the compressed data and their size in.
+ *	@level:		Compression level to use (0 - store the data as they
+ *			are).
+ *	@work:		Compression work buffer (compress_work_size bytes).
+ *
+ *	If the data don't appear to be compressible or they don't shrink after
+ *	all, store them in @block as they are and mark it as raw.  Otherwise
+ *	record @level in the flags of @block.  If per-block checksums are used,
+ *	append the checksum of the block to it.
+ *
+ *	Returns the number of bytes in @block, including the header.
+ */
+static ssize_t compress_buffer(void *buf, ssize_t size, struct buf_block *block,
+				int level, void *work)
+{
+#ifdef CONFIG_COMPRESS
+	ssize_t cnt = -1;
+	uint64_t sum;
+
+	if (level > 0 && !probe_incompressible(buf, size))
+		cnt = compressor->compress(buf, size, block->data,
+				compress_buf_size - BUF_BLOCK_HEADER_SIZE -
+					BUF_BLOCK_CHECKSUM_SIZE,
+				level, work, compress_work_size);
+	if (cnt >= 0 && cnt < size) {
+		block->flags = level << BUF_BLOCK_LEVEL_SHIFT;
+	} else {
+		memcpy(block->data, buf, size);
+		block->flags = BUF_BLOCK_RAW;
+		cnt = size;
+	}
+	block->size = cnt;
+	if (block_checksum) {
+		sum = checksum->compute(block, BUF_BLOCK_HEADER_SIZE + cnt);
+		memcpy(block->data + cnt, &sum, BUF_BLOCK_CHECKSUM_SIZE);
+		cnt += BUF_BLOCK_CHECKSUM_SIZE;
+	}
+	return cnt + BUF_BLOCK_HEADER_SIZE;
+#else
+	(void)buf;
+	(void)size;
+	(void)block;
+	(void)level;
+	(void)work;
+	return -ENOSYS;
+#endif
+}
+
 /*
- * If threads are used for saving the image with compression and encryption,
- * there are three of them.
- *
- * The main one reads image pages from the kernel and puts them into a work
- * buffer.  When the work buffer is full, it gets compressed, but that's not an
- * in-place compression, so the result has to be stored somewhere else.  There
- * are four so-called "write" buffers for that and the first empty "write"
- * buffer is used as the target.  If all of the "write" buffers are full, the
- * thread has to wait (see the rules below).  Otherwise, after placing the
- * (compressed) contents of the work buffer into a "write" buffer, the main
- * thread regards the work buffer as empty and starts to read more image pages
- * from the kernel.
- *
- * The second thread (call it the "move" thread) encrypts the contents of the
- * "write" buffers, one buffer at a time.  It really encrypts individual pages
- * and the encryption is not in-place, too.  The encrypted pages of data are
- * placed in yet another buffer (call it the "encrypt" buffer) until it's full,
- * in which case the "move" thread has to wait. Of course, it also has to wait
- * for data from the main thread if all of the "write" buffers are empty.
- * After encrypting an entire "write" buffer, the "move" thread progresses to
- * the next "write" buffer, in a round-robin manner.
- *
- * The synchronization between the main thread and the "move" thread is done
- * with the help of two index variables, move_start and move_end. �The rule
- * is that:
- * (1) the main thread can only put data into write_buffers[move_start],
- * (2) after putting data into write_buffers[move_start], the main thread
- *     increases move_start, modulo the number of "write" buffers, but
- *     move_start cannot be modified as long as the _next_ "write" buffer is
- *     write_buffers[move_end] (the thread has to wait if that happens),
- * (3) the "move" thread can only read data from write_buffers[move_end] and
- *     only if move_end != move_start (it has to wait if that's not the case),
- * (4) after reading data from write_buffers[move_end], the "move" thread
- *     increases move_end, modulo the number of "write" buffers.
- * This way, move_end always "follows" move_start and the threads don't access
- * the same buffer at any time.
- *
- * The third thread (call it the "save" thread) reads (encrypted) pages of data
- * from the "encrypt" buffer and writes them out to the swap.  This is done if
- * there are some pages to write in the "encrypt" buffer, otherwise the "save"
- * thread has to wait for the "move" thread to put more pages in there.
- *
- * The synchronization between the "move" thread and the "save" thread is done
- * with the help of two pointers, save_start and save_end, where save_start
- * points to the first empty page and save_end points to the last data page
- * that hasn't been written out yet.  Thus, the rule is:
- * (1) the "move" thread can only put data into the page pointed to by
- *     save_start,
- * (2) after putting data into the page pointed to by save_start, the "move"
- *     thread increases save_start, modulo the number of pages in the buffer,
- *     provided that the _next_ page is not the one pointed to by save_end (it
- *     has to wait if that happens),
- * (3) the "save" thread can only read from the page pointed to by save_end,
- *     as long as save_end != save_start (it has to wait if the two pointers
- *     are equal),
- * (4) after writing data from the page pointed to by save_end, the "save"
- *     thread increases save_end, modulo the number of pages in the buffer.
- * IOW, the "encrypt" buffer is handled as a typical circular buffer with one
- * producer (the "move" thread) and one consumer (the "save" thread).
- *
- * If encryption is not used, the "save" thread is not started and the "move"
- * thread writes data to the swap directly out of the "write" buffers.
+ * The image data are saved with the help of a pipeline (see pipeline.h).  The
+ * main thread reads image pages from the kernel into a block of the pipeline
+ * and, when the block is full, submits it to the pipeline and gets the next
+ * empty block.  Every page is turned into a page record, if so configured, and
+ * added to the MD5 checksum of the image right after it has been read, while
+ * it is still in the CPU cache (see read_pages()).  The stages of the pipeline
+ * are:
+ *
+ * "compress"	- compress the block (run by the "compress" threads, if there
+ *		  are any, or by the main thread otherwise),
+ * "encrypt"	- encrypt the block,
+ * "write"	- write the block to the swap.
+ *
+ * If threads are used, the "write" stage is run by a thread of its own, and so
+ * is the "encrypt" stage, unless AES is used with "compress" threads.  In that
+ * case each block of data is encrypted with its own range of counter values
+ * (see set_block_counter()), so the blocks need not be encrypted in order.
+ * There is no "encrypt" stage then and each "compress" thread encrypts the
+ * blocks it has compressed in compress_block().  There are
+ * nr_write_buffers blocks in the pipeline, so the main thread has to wait if
+ * all of them are being processed.
+ *
+ * If threads are not used, all of the stages are run by the main thread and
+ * there is only one block in the pipeline.
  */
 
-static int save_ret;
-static pthread_mutex_t finish_mutex;
-static pthread_cond_t finish_cond;
+/**
+ *	struct compress_worker - resources of a "compress" thread (or of the
+ *			main thread, if there are no "compress" threads)
+ */
+struct compress_worker {
+	void *work_buffer;
+#ifdef CONFIG_ENCRYPT
+	gcry_cipher_hd_t cipher;
+#endif
+};
 
-static char *encrypt_buf;
-static char *save_start, *save_end;
-static pthread_mutex_t save_mutex;
-static pthread_cond_t save_cond;
-static pthread_t save_th;
+static struct compress_worker compress_workers[COMPRESS_THREADS_MAX];
+/* Set if the "compress" threads have to encrypt the data */
+static char compress_encrypt;
 
-struct write_buffer {
-	ssize_t size;
-	void *start;
-};
+#ifdef CONFIG_COMPRESS
+/*
+ * If "compress level max" is set, the compression level is chosen for every
+ * block by a controller trying to keep both the "compress" stage and the
+ * "write" stage of the pipeline busy.  The "compress" stage measures how much
+ * time it takes to compress a byte of image data at the current level (divided
+ * by the number of CPUs running the "compress" threads) and how well the data
+ * compress, the "write" stage measures how much time it takes to write a byte
+ * to the swap.  With io_uring the "write" stage only submits the writes, so
+ * the time it takes to write a byte is measured by the ring as the time with
+ * writes in flight (see swap_ring_busy()).  Every LEVEL_CONTROL_BLOCKS blocks
+ * the "write" stage compares the cost of compressing a byte of image data with
+ * the cost of writing out the result and raises the level if writing is
+ * slower, or lowers it if compression is slower, by more than
+ * LEVEL_CONTROL_MARGIN percent.  Level 0 means storing the blocks without
+ * compression.  If the balance point lies between two levels, the controller
+ * alternates between them.
+ */
+#define LEVEL_CONTROL_BLOCKS	16
+#define LEVEL_CONTROL_MARGIN	25
+
+static struct level_control {
+	char enabled;
+	int max_level;
+	int workers;
+	atomic_int level;
+	/* Updated by the "compress" stage */
+	atomic_ulong compress_time;
+	atomic_ulong in_bytes;
+	atomic_ulong out_bytes;
+	atomic_ulong nr_level_blocks[BUF_BLOCK_LEVELS];
+	/* Updated by the "write" stage */
+	unsigned long write_time;
+	unsigned long write_bytes;
+	/* Values returned by swap_ring_busy() last time */
+	unsigned long ring_time;
+	unsigned long ring_bytes;
+	unsigned int nr_blocks;
+	unsigned int nr_changes;
+} level_ctl;
 
-static struct write_buffer write_buffers[WRITE_BUFFERS];
-static int move_start, move_end;
-static pthread_mutex_t move_mutex;
-static pthread_cond_t move_cond;
-static pthread_t move_th;
+/**
+ *	init_level_control - set up the compression level controller
+ *
+ *	Return the highest compression level that may be used.
+ */
+static int init_level_control(void)
+{
+	int j;
 
-#define FORCE_EXIT	1
+	level_ctl.enabled = compress_level_max > 0;
+	if (!level_ctl.enabled)
+		return compress_level;
+
+	/* The "compress" threads can't run faster than the CPUs they share */
+	level_ctl.workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (level_ctl.workers <= 0 || level_ctl.workers > compress_threads)
+		level_ctl.workers = compress_threads > 0 ? compress_threads : 1;
+
+	level_ctl.max_level = compress_level_max < compressor->max_level ?
+				compress_level_max : compressor->max_level;
+	if (level_ctl.max_level >= BUF_BLOCK_LEVELS)
+		level_ctl.max_level = BUF_BLOCK_LEVELS - 1;
+	atomic_init(&level_ctl.level, compress_level < level_ctl.max_level ?
+				compress_level : level_ctl.max_level);
+	atomic_init(&level_ctl.compress_time, 0);
+	atomic_init(&level_ctl.in_bytes, 0);
+	atomic_init(&level_ctl.out_bytes, 0);
+	for (j = 0; j < BUF_BLOCK_LEVELS; j++)
+		atomic_init(&level_ctl.nr_level_blocks[j], 0);
+	return level_ctl.max_level > compress_level ?
+				level_ctl.max_level : compress_level;
+}
 
-static char *save_inc(char *ptr)
+/**
+ *	work_mem_size - size of the compression work memory of one thread
+ *	@max_level:	Highest compression level that may be used.
+ *
+ *	The work memory has to fit every level that may be used.
+ */
+static size_t work_mem_size(int max_level)
 {
-	return encrypt_buf +
-		(((ptr - encrypt_buf) + page_size) % encrypt_buf_size);
+	size_t size = 0, s;
+	int level;
+
+	for (level = compressor->min_level; level <= max_level; level++) {
+		s = compressor->work_size(level, buffer_size);
+		if (s > size)
+			size = s;
+	}
+	return round_up_page_size(size);
 }
 
-static int move_inc(int index)
+static inline unsigned long elapsed_usec(struct timeval *begin)
 {
-	return (index + 1) % WRITE_BUFFERS;
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, begin, &end);
+	return end.tv_sec * 1000000UL + end.tv_usec;
 }
 
-static int wait_for_finish(void)
+/**
+ *	adjust_level - move the compression level towards the balance point
+ *
+ *	Called by the "write" stage every LEVEL_CONTROL_BLOCKS blocks.
+ */
+static void adjust_level(void)
 {
-	pthread_mutex_lock(&finish_mutex);
-	while((save_end != save_start || move_start != move_end) && !save_ret)
-		pthread_cond_wait(&finish_cond, &finish_mutex);
-	pthread_mutex_unlock(&finish_mutex);
-	return save_ret;
+	unsigned long ctime, in, out;
+	double compress_cost, write_cost;
+	int level;
+
+	ctime = atomic_exchange(&level_ctl.compress_time, 0);
+	in = atomic_exchange(&level_ctl.in_bytes, 0);
+	out = atomic_exchange(&level_ctl.out_bytes, 0);
+	if (!in || !level_ctl.write_bytes)
+		goto Reset;
+
+	compress_cost = (double)ctime / in / level_ctl.workers;
+	write_cost = (double)level_ctl.write_time / level_ctl.write_bytes *
+				out / in;
+	level = atomic_load(&level_ctl.level);
+	if (compress_cost * (100 + LEVEL_CONTROL_MARGIN) < write_cost * 100) {
+		if (level < level_ctl.max_level)
+			level++;
+	} else if (write_cost * (100 + LEVEL_CONTROL_MARGIN) <
+						compress_cost * 100) {
+		if (level > 0)
+			level--;
+	}
+	if (level != atomic_load(&level_ctl.level)) {
+		atomic_store(&level_ctl.level, level);
+		level_ctl.nr_changes++;
+	}
+ Reset:
+	level_ctl.write_time = 0;
+	level_ctl.write_bytes = 0;
 }
 
-static void *save_thread(void *arg)
+static inline int block_level(void)
 {
-	struct swap_writer *handle = arg;
-	int error = 0;
+	return level_ctl.enabled ?
+			atomic_load(&level_ctl.level) : compress_level;
+}
 
-	for (;;) {
-		/* Wait until there is a buffer ready for processing. */
-		pthread_mutex_lock(&save_mutex);
-		while(save_end == save_start && !save_ret)
-			pthread_cond_wait(&save_cond, &save_mutex);
-		pthread_mutex_unlock(&save_mutex);
+static void account_compress(int level, struct timeval *begin,
+				ssize_t in, ssize_t out)
+{
+	if (!level_ctl.enabled)
+		return;
 
-		if (save_ret)
-			return NULL;
+	atomic_fetch_add(&level_ctl.compress_time, elapsed_usec(begin));
+	atomic_fetch_add(&level_ctl.in_bytes, in);
+	atomic_fetch_add(&level_ctl.out_bytes, out);
+	atomic_fetch_add(&level_ctl.nr_level_blocks[level], 1);
+}
 
-		error = save_page(handle, save_end);
-		if (error) {
-			pthread_mutex_lock(&finish_mutex);
-			if (!save_ret)
-				save_ret = error;
-			pthread_mutex_unlock(&finish_mutex);
-			pthread_cond_signal(&move_cond);
-			pthread_cond_signal(&save_cond);
-			pthread_cond_signal(&finish_cond);
-			return NULL;
-		}
+/**
+ *	start_level_control - prepare for measuring the writes to a new ring
+ */
+static void start_level_control(void)
+{
+	level_ctl.ring_time = 0;
+	level_ctl.ring_bytes = 0;
+}
 
-		/* Go to the next page */
-		pthread_mutex_lock(&finish_mutex);
-		pthread_mutex_lock(&save_mutex);
-		save_end = save_inc(save_end);
-		pthread_mutex_unlock(&save_mutex);
-		pthread_mutex_unlock(&finish_mutex);
+static void account_write(struct swap_io *io, struct timeval *begin,
+				ssize_t size)
+{
+	(void)io;
+	if (!level_ctl.enabled)
+		return;
 
-		pthread_cond_signal(&save_cond);
-		pthread_cond_signal(&finish_cond);
-	}
+#ifdef CONFIG_IO_URING
+	if (io->ring) {
+		unsigned long time, bytes;
 
-	return NULL;
+		time = swap_ring_busy(io->ring, &bytes);
+		level_ctl.write_time += time - level_ctl.ring_time;
+		level_ctl.write_bytes += bytes - level_ctl.ring_bytes;
+		level_ctl.ring_time = time;
+		level_ctl.ring_bytes = bytes;
+	} else
+#endif
+	{
+		level_ctl.write_time += elapsed_usec(begin);
+		level_ctl.write_bytes += size;
+	}
+	if (++level_ctl.nr_blocks % LEVEL_CONTROL_BLOCKS == 0)
+		adjust_level();
 }
 
-#ifdef CONFIG_ENCRYPT
-
-static void encrypt_and_save_buffer(void)
+/**
+ *	print_level_stats - print the numbers of blocks compressed at each level
+ */
+static void print_level_stats(void)
 {
-	char *src;
-	ssize_t buf_size, moved_size;
-
-	/*
-	 * The buffer to process is at write_buffers[move_end].start and the
-	 * size of it is write_buffers[move_end].size .
-	 */
-	src = write_buffers[move_end].start;
-	buf_size = write_buffers[move_end].size;
-	moved_size = 0;
-	do {
-		int error;
-		void *next_start;
+	unsigned long n;
+	int j;
 
-		/* Encrypt page_size of data. */
-		error = gcry_cipher_encrypt(cipher_handle,
-						save_start, page_size,
-							src, page_size);
-		if (error) {
-			pthread_mutex_lock(&finish_mutex);
-			if (!save_ret)
-				save_ret = error;
-			pthread_mutex_unlock(&finish_mutex);
-			pthread_cond_signal(&move_cond);
-			pthread_cond_signal(&save_cond);
-			pthread_cond_signal(&finish_cond);
-			break;
-		}
+	if (!level_ctl.enabled)
+		return;
 
-		moved_size += page_size;
-		src += page_size;
+	printf("%s: Compression level changed %u times, blocks per level:",
+		my_name, level_ctl.nr_changes);
+	for (j = 0; j <= level_ctl.max_level; j++) {
+		n = atomic_load(&level_ctl.nr_level_blocks[j]);
+		if (n)
+			printf(" %d: %lu", j, n);
+	}
+	printf("\n");
+}
+#else /* !CONFIG_COMPRESS */
+static inline int block_level(void) { return 0; }
+static inline void account_compress(int level, struct timeval *begin,
+				ssize_t in, ssize_t out)
+{
+	(void)level;
+	(void)begin;
+	(void)in;
+	(void)out;
+}
+static inline void start_level_control(void) {}
+static inline void account_write(struct swap_io *io, struct timeval *begin,
+				ssize_t size)
+{
+	(void)io;
+	(void)begin;
+	(void)size;
+}
+static inline void print_level_stats(void) {}
+#endif /* !CONFIG_COMPRESS */
 
-		pthread_mutex_lock(&save_mutex);
-		next_start = save_inc(save_start);
-		while (next_start == save_end && !save_ret)
-			pthread_cond_wait(&save_cond, &save_mutex);
-		save_start = next_start;
-		pthread_mutex_unlock(&save_mutex);
+#ifdef CONFIG_ENCRYPT
+static int encrypt_block(struct pipeline_block *block, int worker, void *data)
+{
+	gcry_cipher_hd_t hd;
+	int error = 0;
 
-		pthread_cond_signal(&save_cond);
-	} while (moved_size < buf_size && !save_ret);
+	(void)data;
+	hd = compress_encrypt ? compress_workers[worker].cipher : cipher_handle;
+	if (use_aes)
+		error = set_block_counter(hd, key_data.ivec, block->index);
+	if (!error)
+		error = gcry_cipher_encrypt(hd, block->data,
+				round_up_page_size(block->size), NULL, 0);
+	return error;
 }
 
-#else /* !CONFIG_ENCRYPT */
+static int open_compress_cipher(struct compress_worker *cw)
+{
+	int error;
 
-static inline void encrypt_and_save_buffer(void) {}
+	error = open_image_cipher(&cw->cipher, 1);
+	if (error)
+		return error;
+	error = gcry_cipher_setkey(cw->cipher, key_data.key, KEY_SIZE);
+	if (error)
+		gcry_cipher_close(cw->cipher);
+	return error;
+}
 
+static inline void close_compress_cipher(struct compress_worker *cw)
+{
+	gcry_cipher_close(cw->cipher);
+}
+#else /* !CONFIG_ENCRYPT */
+static int encrypt_block(struct pipeline_block *block, int worker, void *data)
+{
+	(void)block;
+	(void)worker;
+	(void)data;
+	return -ENOSYS;
+}
+static inline int open_compress_cipher(struct compress_worker *cw)
+{
+	(void)cw;
+	return -ENOSYS;
+}
+static inline void close_compress_cipher(struct compress_worker *cw)
+{
+	(void)cw;
+}
 #endif /* !CONFIG_ENCRYPT */
 
-static void save_buffer(struct swap_writer *handle)
+static int compress_block(struct pipeline_block *block, int worker, void *data)
 {
-	void *src;
+	struct timeval begin;
 	ssize_t size;
+	int level;
 
-	/*
-	 * The buffer to process is at write_buffers[move_end].start and the
-	 * size of it is write_buffers[move_end].size .
-	 */
-	src = write_buffers[move_end].start;
-	size = write_buffers[move_end].size;
-	while (size > 0) {
-		int error = save_page(handle, src);
-		if (error) {
-			pthread_mutex_lock(&finish_mutex);
-			if (!save_ret)
-				save_ret = error;
-			pthread_mutex_unlock(&finish_mutex);
-			pthread_cond_signal(&move_cond);
-			pthread_cond_signal(&finish_cond);
-			break;
-		}
-		src += page_size;
-		size -= page_size;
-	}
+	(void)data;
+	level = block_level();
+	gettimeofday(&begin, NULL);
+	size = compress_buffer(block->data, block->size, block->aux, level,
+				compress_workers[worker].work_buffer);
+	if (size < 0)
+		return size;
+	account_compress(level, &begin, block->size, size);
+	pipeline_swap_buffers(block);
+	block->size = size;
+	/* Encrypt the block while it is still in the cache */
+	return compress_encrypt ? encrypt_block(block, worker, data) : 0;
 }
 
-static void *move_thread(void *arg)
+static int write_block(struct pipeline_block *block, int worker, void *data)
 {
-	struct swap_writer *handle = arg;
-
-	for (;;) {
-		/* Wait until there is a buffer ready for processing. */
-		pthread_mutex_lock(&move_mutex);
-		while(move_end == move_start && !save_ret)
-			pthread_cond_wait(&move_cond, &move_mutex);
-		pthread_mutex_unlock(&move_mutex);
-
-		if (save_ret)
-			break;
-
-		if (do_encrypt)
-			encrypt_and_save_buffer();
-		else
-			save_buffer(handle);
-
-		if (save_ret)
-			break;
+	struct swap_writer *handle = data;
+	char *src = block->data;
+	ssize_t size = block->size;
+	struct timeval begin;
+	int error = 0;
 
-		/* Tell the reader thread that we have processed the buffer */
-		pthread_mutex_lock(&finish_mutex);
-		pthread_mutex_lock(&move_mutex);
-		move_end = move_inc(move_end);
-		pthread_mutex_unlock(&move_mutex);
-		pthread_mutex_unlock(&finish_mutex);
+	(void)worker;
+	gettimeofday(&begin, NULL);
+	handle->io.tag = block;
+	if (handle->index && !handle->index_overflow) {
+		unsigned char *p = handle->index + handle->index_size;
 
-		pthread_cond_signal(&move_cond);
-		pthread_cond_signal(&finish_cond);
+		if (handle->index_size + 2 * VARINT_MAX >
+					IMAGE_INDEX_PAGES * page_size) {
+			handle->index_overflow = 1;
+		} else {
+			p += put_varint(p, block->nr_pages);
+			p += put_varint(p, (size - 1) / page_size);
+			handle->index_size = p - handle->index;
+		}
 	}
-
-	return NULL;
+	while (size > 0) {
+		error = save_page(handle, src);
+		if (error)
+			return error;
+		src += page_size;
+		size -= page_size;
+	}
+	/*
+	 * The block is going to be reused, so write out all of it (with
+	 * io_uring it is only released after the writes have completed).
+	 */
+	error = swap_io_flush(&handle->io);
+	if (!error)
+		account_write(&handle->io, &begin, block->size);
+	return error;
 }
 
-static inline void *current_write_buffer(void)
+#ifdef CONFIG_IO_URING
+static void hold_block(void *tag)
 {
-	return write_buffers[move_start].start;
+	pipeline_hold(tag);
 }
 
-static int prepare_next_write_buffer(ssize_t size)
+static void release_block(void *tag, int error, void *data)
 {
-	int next_start;
-
-	/* Move to the next buffer and signal that the current one is ready*/
-	write_buffers[move_start].size = size;
-
-	pthread_mutex_lock(&move_mutex);
-	next_start = move_inc(move_start);
-	while (next_start == move_end && !save_ret)
-		pthread_cond_wait(&move_cond, &move_mutex);
-	move_start = next_start;
-	pthread_mutex_unlock(&move_mutex);
-
-	pthread_cond_signal(&move_cond);
+	struct pipeline *p = data;
 
-	return save_ret;
+	if (error)
+		pipeline_set_error(p, error);
+	pipeline_release(p, tag);
 }
+#endif
 
-static void start_threads(struct swap_writer *handle)
+/**
+ *	setup_pipeline - add the stages to the pipeline and start it
+ */
+static void setup_pipeline(struct swap_writer *handle)
 {
-	int error;
-	unsigned int write_buf_size;
-	char *write_buf;
+	struct pipeline *p = &handle->pipeline;
 	int j;
 
-	encrypt_buf = handle->encrypt_buffer;
-	save_start = encrypt_buf;
-	save_end = save_start;
-
-	write_buf_size = do_compress ? compress_buf_size : buffer_size;
-	write_buf = handle->write_buffer;
-	for (j = 0; j < WRITE_BUFFERS; j++) {
-		write_buffers[j].start = write_buf;
-		write_buf += write_buf_size;
-	}
-	move_start = 0;
-	move_end = move_start;
-
-	if (do_encrypt) {
-		error = pthread_mutex_init(&save_mutex, NULL);
-		if (error) {
-			perror("pthread_mutex_init() failed:");
-			goto Error_exit;
-		}
-		error = pthread_cond_init(&save_cond, NULL);
-		if (error) {
-			perror("pthread_cond_init() failed:");
-			goto Destroy_save_mutex;
-		}
-	}
-
-	error = pthread_mutex_init(&move_mutex, NULL);
-	if (error) {
-		perror("pthread_mutex_init() failed:");
-		goto Destroy_save_cond;
-	}
-	error = pthread_cond_init(&move_cond, NULL);
-	if (error) {
-		perror("pthread_cond_init() failed:");
-		goto Destroy_move_mutex;
-	}
-
-	if (do_encrypt) {
-		error = pthread_create(&save_th, NULL, save_thread, handle);
-		if (error) {
-			perror("pthread_create() failed:");
-			goto Destroy_move_cond;
+	if (do_compress)
+		for (j = 0; j < (compress_threads > 0 ? compress_threads : 1); j++)
+			compress_workers[j].work_buffer =
+				(char *)handle->compress_work_buffer +
+					j * compress_work_size;
+
+	compress_encrypt = do_encrypt && use_aes && compress_threads > 0;
+	for (j = 0; compress_encrypt && j < compress_threads; j++)
+		if (open_compress_cipher(compress_workers + j)) {
+			fprintf(stderr, "%s: Failed to set up encryption in "
+				"the compress threads\n", my_name);
+			while (--j >= 0)
+				close_compress_cipher(compress_workers + j);
+			compress_encrypt = 0;
 		}
-	}
-
-	error = pthread_create(&move_th, NULL, move_thread, handle);
-	if (error) {
-		perror("pthread_create() failed:");
-		goto Stop_save_thread;
-	}
-
-	error = pthread_mutex_init(&finish_mutex, NULL);
-	if (error) {
-		perror("pthread_mutex_init() failed:");
-		goto Stop_move_thread;
-	}
-	error = pthread_cond_init(&finish_cond, NULL);
-	if (error) {
-		perror("pthread_cond_init() failed:");
-		goto Destroy_finish_mutex;
-	}
 
-	return;
-
- Destroy_finish_mutex:
-	pthread_mutex_destroy(&finish_mutex);
+	if (do_compress)
+		pipeline_add_stage(p, "compress", compress_block, NULL,
+					compress_threads);
+	/* The "compress" threads may encrypt the data themselves */
+	if (do_encrypt && !compress_encrypt)
+		pipeline_add_stage(p, "encrypt", encrypt_block, NULL,
+					use_threads ? 1 : 0);
+	pipeline_add_stage(p, "write", write_block, handle,
+				use_threads ? 1 : 0);
+#ifdef CONFIG_IO_URING
+	if (swap_io_depth > 0 && !swap_ring_init(&handle->ring,
+			swap_io_depth, hold_block, release_block, p))
+		handle->io.ring = &handle->ring;
+#endif
+	start_level_control();
+#ifdef CONFIG_THREADS
+	if (use_threads)
+		start_swap_allocator(handle);
+#endif
+	pipeline_start(p, 0, 0);
+}
 
- Stop_move_thread:
-	save_ret = FORCE_EXIT;
-	pthread_cond_signal(&move_cond);
-	pthread_join(move_th, NULL);
+static void stop_pipeline(struct swap_writer *handle)
+{
+	int j;
 
- Stop_save_thread:
-	if (do_encrypt) {
-		save_ret = FORCE_EXIT;
-		pthread_cond_signal(&save_cond);
-		pthread_join(save_th, NULL);
+	pipeline_stop(&handle->pipeline);
+#ifdef CONFIG_THREADS
+	stop_swap_allocator(handle);
+#endif
+#ifdef CONFIG_IO_URING
+	if (handle->io.ring) {
+		swap_ring_exit(handle->io.ring);
+		handle->io.ring = NULL;
 	}
+#endif
+	for (j = 0; compress_encrypt && j < compress_threads; j++)
+		close_compress_cipher(compress_workers + j);
+}
 
- Destroy_move_cond:
-	pthread_cond_destroy(&move_cond);
- Destroy_move_mutex:
-	pthread_mutex_destroy(&move_mutex);
-
- Destroy_save_cond:
-	if (do_encrypt)
-		pthread_cond_destroy(&save_cond);
- Destroy_save_mutex:
-	if (do_encrypt)
-		pthread_mutex_destroy(&save_mutex);
 
- Error_exit:
-	use_threads = 0;
+/**
+ *	next_page_address - address to read the next image data page to
+ *
+ *	If zero pages are eliminated, the buffer contains page records and the
+ *	page data go after the record header.
+ */
+static inline void *next_page_address(struct swap_writer *handle)
+{
+	return sparse_pages ?
+		handle->page_ptr + PAGE_RECORD_HEADER_SIZE : handle->page_ptr;
 }
 
-static void stop_threads(void)
+/**
+ *	commit_page - add the page read to next_page_address() to the buffer
+ */
+static inline void commit_page(struct swap_writer *handle)
 {
-	pthread_mutex_lock(&finish_mutex);
-	if (!save_ret)
-		save_ret = FORCE_EXIT;
-	pthread_mutex_unlock(&finish_mutex);
-
-	pthread_cond_destroy(&finish_cond);
-	pthread_mutex_destroy(&finish_mutex);
+	struct page_cache *cache;
+	size_t size = page_size;
 
-	pthread_cond_signal(&move_cond);
-	pthread_join(move_th, NULL);
-	if (do_encrypt) {
-		pthread_cond_signal(&save_cond);
-		pthread_join(save_th, NULL);
+	handle->block_pages++;
+	if (sparse_pages) {
+		cache = handle->page_cache.pages ? &handle->page_cache : NULL;
+		size = pack_page(handle->page_ptr, cache);
 	}
+	if (handle->image_checksum)
+		md5_process_bytes(handle->page_ptr, size, &handle->ctx);
+	handle->page_ptr += size;
+}
 
-	pthread_cond_destroy(&move_cond);
-	pthread_mutex_destroy(&move_mutex);
+/*
+ * The pages are read by one of the variants of read_pages(), chosen by
+ * save_image() according to the format of the image data and to whether or
+ * not the image checksum is computed.  These are compile-time constants in
+ * each of the variants, so the loop over the pages doesn't check them for
+ * every page.
+ *
+ * Every page is added to the image checksum right after it has been read and
+ * classified, while it is still in the CPU cache (page-pass-bench compares
+ * that with checksumming whole blocks).  Compression and encryption are not
+ * split up in the same way, they still process one block at a time.
+ */
 
-	if (do_encrypt) {
-		pthread_cond_destroy(&save_cond);
-		pthread_mutex_destroy(&save_mutex);
-	}
+/**
+ *	read_pages - read image data pages into the current block
+ *	@handle:	Swap writer.
+ *	@max:		Maximum number of pages to read.
+ *	@end:		Set if there are no more image data pages.
+ *	@sparse:	Store the pages as page records (see classify.h).
+ *	@dedup:		Eliminate duplicate pages.
+ *	@csum:		Add the pages (or their records) to the image checksum.
+ *
+ *	Stop early if there is no room for another page in the block.
+ *	Return the number of pages read or a negative error code.
+ */
+static __always_inline int read_pages(struct swap_writer *handle,
+			unsigned int max, int *end, const int sparse,
+			const int dedup, const int csum)
+{
+	const size_t room = sparse ? PAGE_RECORD_HEADER_SIZE + page_size :
+					page_size;
+	struct page_cache *cache = dedup ? &handle->page_cache : NULL;
+	void *limit = handle->buffer + buffer_size - room;
+	void *ptr = handle->page_ptr;
+	unsigned int n;
+	ssize_t ret;
+	size_t size;
+	int error = 0;
+
+	for (n = 0; n < max && ptr <= limit; n++) {
+		ret = read(handle->input, sparse ?
+				ptr + PAGE_RECORD_HEADER_SIZE : ptr, page_size);
+		if (ret < page_size) {
+			if (ret < 0) {
+				error = -EIO;
+				perror("\nError reading an image page");
+			} else if (ret > 0) {
+				error = -EFAULT;
+				perror("\nShort read from /dev/snapshot?");
+			}
+			*end = 1;
+			break;
+		}
+		size = sparse ? pack_page(ptr, cache) : page_size;
+		if (csum)
+			md5_process_bytes(ptr, size, &handle->ctx);
+		ptr += size;
+	}
+	handle->page_ptr = ptr;
+	handle->block_pages += n;
+	return error ? error : (int)n;
 }
 
-#else /* !CONFIG_THREADS */
+typedef int (*read_pages_fn)(struct swap_writer *handle, unsigned int max,
+				int *end);
 
-static inline int wait_for_finish(void) { return -ENOSYS; }
-static inline void *current_write_buffer(void) { return NULL; }
-static inline int prepare_next_write_buffer(ssize_t size)
-{
-	(void)size;
-	return -ENOSYS;
+#define DEFINE_READ_PAGES(name, sparse, dedup, csum)			\
+static int name(struct swap_writer *handle, unsigned int max, int *end)	\
+{									\
+	return read_pages(handle, max, end, sparse, dedup, csum);	\
 }
-static inline void start_threads(struct swap_writer *handle) { (void)handle; }
-static inline void stop_threads(void) {}
 
-#endif /* !CONFIG_THREADS */
+DEFINE_READ_PAGES(read_raw_pages, 0, 0, 0)
+DEFINE_READ_PAGES(read_raw_pages_csum, 0, 0, 1)
+DEFINE_READ_PAGES(read_sparse_pages, 1, 0, 0)
+DEFINE_READ_PAGES(read_sparse_pages_csum, 1, 0, 1)
+DEFINE_READ_PAGES(read_dedup_pages, 1, 1, 0)
+DEFINE_READ_PAGES(read_dedup_pages_csum, 1, 1, 1)
+
+/* Indexed by the format of the image data and by the image_checksum flag */
+static const read_pages_fn read_pages_fns[3][2] = {
+	{ read_raw_pages, read_raw_pages_csum },
+	{ read_sparse_pages, read_sparse_pages_csum },
+	{ read_dedup_pages, read_dedup_pages_csum },
+};
 
 /**
- *	encrypt_and_save_page - encrypt a page of data and write it to the swap
+ *	buffer_full - check if there's no room for another page in the buffer
  */
-static int encrypt_and_save_page(struct swap_writer *handle, void *src)
+static inline int buffer_full(struct swap_writer *handle)
 {
-#ifdef CONFIG_ENCRYPT
-	if (do_encrypt) {
-		int error = gcry_cipher_encrypt(cipher_handle,
-			handle->encrypt_ptr, page_size, src, page_size);
-		if (error)
-			return error;
-		src = handle->encrypt_ptr;
-		handle->encrypt_ptr += page_size;
-		if (handle->encrypt_ptr - handle->encrypt_buffer
-		    >= encrypt_buf_size)
-			handle->encrypt_ptr = handle->encrypt_buffer;
-	}
-#endif
-	return save_page(handle, src);
+	size_t room = buffer_size - (handle->page_ptr - handle->buffer);
+
+	return room < (sparse_pages ?
+			PAGE_RECORD_HEADER_SIZE + page_size : page_size);
 }
 
 /**
@@ -1205,52 +1851,21 @@ static int encrypt_and_save_page(struct swap_writer *handle, void *src)
  */
 static int flush_buffer(struct swap_writer *handle)
 {
+	struct pipeline_block *block = handle->block;
 	ssize_t size;
-	char *src;
-	int error = 0;
+	int error;
 
 	/* Check if there is anything to do */
 	if (handle->page_ptr <= handle->buffer)
 		return 0;
 
 	size = handle->page_ptr - handle->buffer;
-	if (compute_checksum || verify_image)
-		md5_process_block(handle->buffer, size, &handle->ctx);
-
-	src = use_threads ? current_write_buffer() : handle->write_buffer;
-
-	/* Compress the buffer, if necessary */
-	if (do_compress) {
-#ifdef CONFIG_COMPRESS
-		struct buf_block *block = (struct buf_block *)src;
-		lzo_uint cnt;
-
-		lzo1x_1_compress(handle->buffer, size,
-					(lzo_bytep)block->data, &cnt,
-						handle->lzo_work_buffer);
-		block->size = cnt;
-		size = cnt + sizeof(size_t);
-#endif
-	} else if (use_threads) {
-		memcpy(src, handle->buffer, size);
-	}
-
-	if (use_threads)
-		return prepare_next_write_buffer(size);
-
-	/*
-	 * If there's no compression and threads are not used, handle->buffer is
-	 * equal to handle->write_buffer.  In that case, the data are taken
-	 * directly out of handle->buffer.
-	 */
-	while (size > 0) {
-		error = encrypt_and_save_page(handle, src);
-		if (error)
-			break;
-		src += page_size;
-		size -= page_size;
-	}
+	block->size = size;
+	block->nr_pages = handle->block_pages;
 
+	error = pipeline_submit(&handle->pipeline, block);
+	if (!error)
+		error = next_block(handle);
 	return error;
 }
 
@@ -1259,10 +1874,11 @@ static int flush_buffer(struct swap_writer *handle)
  */
 static int save_image(struct swap_writer *handle, unsigned int nr_pages)
 {
-	unsigned int m, writeout_rate;
-	ssize_t ret;
+	read_pages_fn read_fn;
+	unsigned int m;
+	int ret, end = 0;
 	struct termios newtrm, savedtrm;
-	int abort_possible, key, error = 0;
+	int abort_possible, key, direct, error = 0;
 	char message[SPLASH_GENERIC_MESSAGE_SIZE];
 
 	/* Switch the state of the terminal so that we can read the keyboard
@@ -1279,34 +1895,24 @@ static int save_image(struct swap_writer *handle, unsigned int nr_pages)
 	printf("%s: %s     ", my_name, message);
 	splash.set_caption(message);
 
-	if (use_threads)
-		start_threads(handle);
+	setup_pipeline(handle);
+	direct = swap_io_set_direct(handle->fd, swap_io_direct);
 
 	m = nr_pages / 100;
 	if (!m)
 		m = 1;
 
-	if (early_writeout)
-		writeout_rate = m;
-	else
-		writeout_rate = nr_pages + 1;
-
-	/* The buffer may be partially filled at this point */
-	for (nr_pages = 0; ; nr_pages++) {
-		ret = read(handle->input, handle->page_ptr, page_size);
-		if (ret < page_size) {
-			if (ret < 0) {
-				error = -EIO;
-				perror("\nError reading an image page");
-			} else if (ret > 0) {
-				error = -EFAULT;
-				perror("\nShort read from /dev/snapshot?");
-			}
-			break;
-		}
+	/* There's nothing to write out early if the page cache is bypassed */
+	if (early_writeout && !direct) {
+		swap_writeout_init(&handle->writeout, handle->fd);
+		handle->io.writeout = &handle->writeout;
+	}
 
-		handle->page_ptr += page_size;
+	read_fn = read_pages_fns[sparse_pages ?
+				(handle->page_cache.pages ? 2 : 1) : 0]
+				[!!handle->image_checksum];
 
+	for (nr_pages = 0; ; ) {
 		if (!(nr_pages % m)) {
 			printf("\b\b\b\b%3d%%", nr_pages / m);
 			splash.progress(20 + (nr_pages / m) * 0.75);
@@ -1331,32 +1937,89 @@ static int save_image(struct swap_writer *handle, unsigned int nr_pages)
 			}
 		}
 
-		if (!((nr_pages + 1) % writeout_rate))
-			start_writeout(handle->fd);
+		/* Read pages up to the next progress update */
+		ret = read_fn(handle, m - nr_pages % m, &end);
+		if (ret < 0) {
+			error = ret;
+			break;
+		}
+		nr_pages += ret;
+		if (end)
+			break;
 
-		if (handle->page_ptr - handle->buffer >= buffer_size) {
+		if (buffer_full(handle)) {
 			/* The buffer is full, flush it */
 			error = flush_buffer(handle);
 			if (error)
 				break;
-			handle->page_ptr = handle->buffer;
 		}
 	}
 
 	if (!error) {
 		/* Flush whatever's left in the buffer and save the extents */
 		error = flush_buffer(handle);
-		if (use_threads)
-			error = wait_for_finish();
 		if (!error)
-			error = save_extents(handle, 1);
+			error = pipeline_finish(&handle->pipeline);
+		if (!error)
+			error = swap_io_wait(&handle->io);
+#ifdef CONFIG_THREADS
+		/*
+		 * The image data are all in place, so the allocator is not
+		 * needed any more and the swap for the extents and the metadata
+		 * is allocated here without racing with it.
+		 */
+		stop_swap_allocator(handle);
+#endif
 		if (!error)
+			error = save_extents(handle, 0);
+		if (!error) {
+			if (handle->map_overflow)
+				handle->map_size = 0;
+			if (handle->map_size)
+				save_metadata(handle, handle->map,
+					&handle->map_size, handle->map_pages);
+			if (handle->index_overflow)
+				handle->index_size = 0;
+			if (handle->index_size)
+				save_metadata(handle, handle->index,
+					&handle->index_size,
+					handle->index_pages);
 			printf(" done (%u pages)\n", nr_pages);
+			if (do_compress)
+				print_level_stats();
+		}
+		if (handle->io.writeout) {
+			/*
+			 * If saving the data has failed, some of them may
+			 * still be in the ring and added to the window when
+			 * their writes complete.  The metadata are written
+			 * with write_page() and don't go through the window.
+			 */
+			swap_io_wait(&handle->io);
+			swap_writeout_finish(handle->io.writeout);
+		}
 	}
+#ifdef CONFIG_IO_URING
+	if (!error && handle->io.ring)
+		printf("%s: %lu write requests, up to %u in flight\n", my_name,
+			handle->ring.nr_requests, handle->ring.max_in_flight);
+#endif
 
  Exit:
-	if (use_threads)
-		stop_threads();
+	stop_pipeline(handle);
+	if (direct)
+		swap_io_set_direct(handle->fd, 0);
+	if (!error && handle->io.writeout)
+		printf("%s: Waited for the writeback %lu times\n", my_name,
+			handle->writeout.nr_waits);
+	handle->io.writeout = NULL;
+	if (!error)
+		printf("%s: %lu swap pages allocated in %0.1lf ms, "
+			"waited %0.1lf ms\n", my_name, handle->alloc.nr_pages,
+			handle->alloc.alloc_time.tv_sec * 1000.0 +
+				handle->alloc.alloc_time.tv_usec / 1000.0,
+			handle->alloc.wait_time.tv_sec * 1000.0 +
+				handle->alloc.wait_time.tv_usec / 1000.0);
 
 	if (abort_possible)
 		splash.restore_abort(&savedtrm);
@@ -1400,11 +2063,13 @@ static int mark_swap(int fd, loff_t start)
 		memcpy(swsusp_header.orig_sig, swsusp_header.sig, 10);
 		memcpy(swsusp_header.sig, SWSUSP_SIG, 10);
 		swsusp_header.image = start;
-		if (lseek64(fd, shift, SEEK_SET) != shift)
-			return -EIO;
-
-		if (write(fd, &swsusp_header, size) < size)
-			error = -EIO;
+		/*
+		 * The signature and the image location share a sector, so even
+		 * a torn write cannot make the swap look like it holds an image
+		 * anywhere else, and everything the header points to has been
+		 * synced by write_image() already.
+		 */
+		error = swap_io_write_sync(fd, &swsusp_header, size, shift);
 	} else {
 		error = -ENODEV;
 	}
@@ -1461,15 +2126,15 @@ static int write_image(int snapshot_fd, int resume_fd, int test_fd)
 		 * Do it in such a way that save_image() will believe it has
 		 * already read the header page.
 		 */
-		image_header = handle.page_ptr;
+		image_header = next_page_address(&handle);
 		ret = read(snapshot_fd, image_header, page_size);
 		if (ret < page_size) {
 			error = ret < 0 ? ret : -EFAULT;
 			goto Free_writer;
 		}
-		handle.page_ptr += page_size;
 		image_size = image_header->size;
 		nr_pages = image_header->pages;
+		commit_page(&handle);
 		if (!nr_pages) {
 			error = -ENODATA;
 			goto Free_writer;
@@ -1480,12 +2145,32 @@ static int write_image(int snapshot_fd, int resume_fd, int test_fd)
 	printf("%s: Image size: %lu kilobytes\n", my_name, (unsigned long) image_size / 1024);
 	real_size = image_size;
 
+	if (dedup_pages) {
+		error = init_page_cache(&handle.page_cache, 1);
+		if (error)
+			goto Free_writer;
+	}
+
 	handle.swap_needed = image_size;
+#ifdef CONFIG_COMPRESS
 	if (do_compress) {
-		/* This is necessary in case the image is not compressible */
-		handle.swap_needed += round_up_page_size(
-					(handle.swap_needed >> 4) + 67);
+		/*
+		 * This is necessary in case the image is not compressible.
+		 * Incompressible blocks are stored as they are, so each of them
+		 * takes at most one page more than the data in it.
+		 */
+		handle.swap_needed += (handle.swap_needed / buffer_size + 1) *
+								page_size;
+		/*
+		 * If zero pages are eliminated, each page may take up to
+		 * PAGE_RECORD_HEADER_SIZE bytes more and a block holds one
+		 * page less.
+		 */
+		if (sparse_pages)
+			handle.swap_needed += (image_size / buffer_size + 1) *
+						page_size * 2;
 	}
+#endif
 	if (!enough_swap(&handle)) {
 		fprintf(stderr, "%s: Not enough free swap\n", my_name);
 		error = -ENOSPC;
@@ -1506,8 +2191,21 @@ static int write_image(int snapshot_fd, int resume_fd, int test_fd)
 	if (compute_checksum)
 		header->flags |= IMAGE_CHECKSUM;
 
-	if (do_compress)
-		header->flags |= IMAGE_COMPRESSED;
+#ifdef CONFIG_COMPRESS
+	if (do_compress) {
+		header->flags |= IMAGE_COMPRESSED | IMAGE_BLOCK_FLAGS;
+		header->compress_method = compressor->id;
+		header->compress_level = compress_level;
+		if (sparse_pages)
+			header->flags |= IMAGE_SPARSE_PAGES;
+		if (dedup_pages)
+			header->flags |= IMAGE_DEDUP_PAGES;
+		if (block_checksum) {
+			header->flags |= IMAGE_BLOCK_CHECKSUM;
+			header->checksum_method = checksum->id;
+		}
+	}
+#endif
 
 #ifdef CONFIG_ENCRYPT
 	if (!do_encrypt)
@@ -1519,8 +2217,9 @@ static int write_image(int snapshot_fd, int resume_fd, int test_fd)
 		if (error)
 			goto No_RSA;
 
-		error = gcry_cipher_setiv(cipher_handle, key_data.ivec,
-						CIPHER_BLOCK);
+		if (!use_aes)
+			error = gcry_cipher_setiv(cipher_handle, key_data.ivec,
+							CIPHER_BLOCK);
 		if (error)
 			goto No_RSA;
 
@@ -1540,12 +2239,14 @@ No_RSA:
 
 		error = gcry_cipher_setkey(cipher_handle, key_data.key,
 						KEY_SIZE);
-		if (!error)
+		if (!error && !use_aes)
 			error = gcry_cipher_setiv(cipher_handle, key_data.ivec,
 						CIPHER_BLOCK);
 		if (!error)
 			header->flags |= IMAGE_ENCRYPTED;
 	}
+	if (use_aes)
+		header->flags |= IMAGE_AES_CTR;
 
 	if (error) {
 		fprintf(stderr,"%s: libgcrypt error: %s\n", my_name,
@@ -1561,11 +2262,22 @@ Save_image:
 	if (!error) {
 		struct timeval end;
 
-		fsync(resume_fd);
-
 		header->image_data_size = handle.written_data;
 		real_size = handle.written_data;
 
+		if (handle.map_size) {
+			header->flags |= IMAGE_MAP;
+			header->map_size = handle.map_size;
+			memcpy(header->map_pages, handle.map_pages,
+				sizeof(header->map_pages));
+		}
+		if (handle.index_size) {
+			header->flags |= IMAGE_BLOCK_INDEX;
+			header->index_size = handle.index_size;
+			memcpy(header->index_pages, handle.index_pages,
+				sizeof(header->index_pages));
+		}
+
 		/*
 		 * NOTICE: This needs to go after save_image(), because the
 		 * user may modify the behavior.
@@ -1573,7 +2285,7 @@ Save_image:
 		if (shutdown_method == SHUTDOWN_METHOD_PLATFORM)
 			header->flags |= PLATFORM_SUSPEND;
 
-		if (compute_checksum || verify_image)
+		if (handle.image_checksum)
 			md5_finish_ctx(&handle.ctx, header->checksum);
 
 		gettimeofday(&end, NULL);
@@ -1583,7 +2295,13 @@ Save_image:
 		header->resume_pause = resume_pause;
 
 		error = write_page(resume_fd, header, start);
-		fsync(resume_fd);
+		/*
+		 * This is the only flush of the device cache.  It makes the
+		 * image data, the extents and the header durable before
+		 * mark_swap() writes the signature pointing to them.
+		 */
+		if (!error && fsync(resume_fd))
+			error = -errno;
 	}
 
  Free_writer:
@@ -1607,12 +2325,15 @@ Save_image:
 			printf("%s: Compression ratio %4.2lf\n", my_name,
 				real_size / image_size);
 		}
+		if (dedup_pages) {
+			printf("%s: Duplicate pages %lu (%4.2lf%%)\n", my_name,
+				handle.page_cache.nr_dups,
+				100.0 * handle.page_cache.nr_dups / nr_pages);
+		}
 		printf("S");
 		error = mark_swap(resume_fd, start);
-		if (!error) {
-			fsync(resume_fd);
+		if (!error)
 			printf( "|" );
-		}
 		printf("\n");
 	}
 
@@ -1645,15 +2366,8 @@ static int reset_signature(int fd)
 	if (!error) {
 		/* Reset swap signature now */
 		memcpy(swsusp_header.sig, swsusp_header.orig_sig, 10);
-		if (lseek64(fd, shift, SEEK_SET) == shift) {
-			ret = write(fd, &swsusp_header, size);
-			if (ret != size)
-				error = ret < 0 ? ret : -EIO;
-		} else {
-			error = -EIO;
-		}
+		error = swap_io_write_sync(fd, &swsusp_header, size, shift);
 	}
-	fsync(fd);
 	if (error) {
 		fprintf(stderr, "%s: Error %d resetting the image.\n"
 			"There should be valid image on disk. "
@@ -2299,7 +3013,7 @@ int get_config(int argc, char *argv[])
 
 int main(int argc, char *argv[])
 {
-	unsigned int mem_size;
+	size_t mem_size, verify_mem_size, decompress_work_size = 0;
 	struct stat stat_buf;
 	int resume_fd, snapshot_fd, vt_fd, orig_vc = -1, suspend_vc = -1;
 	int test_fd = -1;
@@ -2335,15 +3049,39 @@ int main(int argc, char *argv[])
 #ifdef CONFIG_COMPRESS
 	if (do_compress != 'y' && do_compress != 'Y') {
 		do_compress = 0;
-	} else if (lzo_init() != LZO_E_OK) {
-		suspend_error("Failed to initialize LZO. "
-				"Compression disabled.\n");
-		do_compress = 0;
-	}
+	} else {
+		compressor = find_compressor_by_name(compress_method);
+		if (!compressor) {
+			suspend_error("Compression method %s not supported. "
+					"Using LZO.", compress_method);
+			compressor = find_compressor(COMPRESS_LZO);
+		}
+		if (compressor->init()) {
+			suspend_error("Failed to initialize %s. "
+				"Compression disabled.\n", compressor->name);
+			do_compress = 0;
+		}
+		if (compress_level <= 0)
+			compress_level = compressor->default_level;
+		else if (compress_level < compressor->min_level)
+			compress_level = compressor->min_level;
+		else if (compress_level > compressor->max_level)
+			compress_level = compressor->max_level;
+	}
+	if (!do_compress || (sparse_pages != 'y' && sparse_pages != 'Y'))
+		sparse_pages = 0;
+	if (!sparse_pages || (dedup_pages != 'y' && dedup_pages != 'Y'))
+		dedup_pages = 0;
 #endif
 #ifdef CONFIG_ENCRYPT
-	if (do_encrypt != 'y' && do_encrypt != 'Y')
+	if (do_encrypt != 'y' && do_encrypt != 'Y') {
 		do_encrypt = 0;
+	} else if (!strcasecmp(encrypt_method, "aes")) {
+		use_aes = 1;
+	} else if (strcasecmp(encrypt_method, "blowfish")) {
+		suspend_error("Encryption method %s not supported. "
+				"Using Blowfish.", encrypt_method);
+	}
 #endif
 	if (splash_param != 'y' && splash_param != 'Y')
 		splash_param = 0;
@@ -2353,6 +3091,8 @@ int main(int argc, char *argv[])
 	if (early_writeout != 'n' && early_writeout != 'N')
 		early_writeout = 1;
 
+	swap_io_direct = swap_io_direct != 'n' && swap_io_direct != 'N';
+
 	if (!strcmp (shutdown_method_value, "shutdown")) {
 		shutdown_method = SHUTDOWN_METHOD_SHUTDOWN;
 	} else if (!strcmp (shutdown_method_value, "platform")) {
@@ -2370,51 +3110,82 @@ int main(int argc, char *argv[])
 #ifdef CONFIG_THREADS
 	if (use_threads != 'y' && use_threads != 'Y')
 		use_threads = 0;
+	if (!use_threads || !do_compress) {
+		compress_threads = 0;
+	} else if (compress_threads <= 0) {
+		/* Use as many "compress" threads as there are CPUs */
+		compress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (compress_threads <= 0)
+			compress_threads = 1;
+	}
+	if (compress_threads > COMPRESS_THREADS_MAX)
+		compress_threads = COMPRESS_THREADS_MAX;
+#ifdef CONFIG_IO_URING
+	if (!use_threads || (swap_io_depth > 0 && !swap_ring_supported()))
+		swap_io_depth = 0;
+	if (swap_io_depth > SWAP_IO_DEPTH_MAX)
+		swap_io_depth = SWAP_IO_DEPTH_MAX;
+#else
+	swap_io_depth = 0;
+#endif
+	/* Every write request in flight with io_uring holds a block */
+	nr_write_buffers = WRITE_BUFFERS + compress_threads + swap_io_depth;
 #endif
 
 	get_page_and_buffer_sizes();
 
-	mem_size = 2 * page_size + buffer_size;
 #ifdef CONFIG_COMPRESS
 	if (do_compress) {
-		/*
-		 * The formula below follows from the worst-case expansion
-		 * calculation for LZO1 (size / 16 + 67) and the fact that the
-		 * size of the compressed data must be stored in the buffer
-		 * (sizeof(size_t)).
-		 */
-		compress_buf_size = buffer_size +
-			round_up_page_size((buffer_size >> 4) + 67 +
-						sizeof(size_t));
-		mem_size += compress_buf_size +
-				round_up_page_size(LZO1X_1_MEM_COMPRESS);
+		compress_buf_size = block_buffer_size(
+					compressor->bound(buffer_size));
+		compress_work_size = work_mem_size(init_level_control());
+		/* The image is verified with the same compression method */
+		decompress_work_size = compressor->decompress_work_size();
+		if (page_size / 64 > PAGE_BITMAP_MAX)
+			sparse_pages = 0;
+		if (sparse_pages)
+			classify_init();
+		else
+			dedup_pages = 0;
+
+		checksum = find_checksum_method_by_name(checksum_name);
+		if (!checksum) {
+			suspend_error("Checksum method %s not supported. "
+					"Using MD5.", checksum_name);
+			checksum = find_checksum_method(CHECKSUM_MD5);
+		}
+		if ((compute_checksum || verify_image) && checksum->compute) {
+			checksum_init();
+			block_checksum = 1;
+		}
 	}
 #endif
 #ifdef CONFIG_ENCRYPT
 	if (do_encrypt) {
 		printf("%s: libgcrypt version: %s\n", my_name,
 			gcry_check_version(NULL));
-		gcry_control(GCRYCTL_INIT_SECMEM, page_size, 0);
-		ret = gcry_cipher_open(&cipher_handle, IMAGE_CIPHER,
-				GCRY_CIPHER_MODE_CFB, GCRY_CIPHER_SECURE);
+		/* The "compress" threads may need cipher handles too */
+		gcry_control(GCRYCTL_INIT_SECMEM,
+				(1 + compress_threads) * page_size, 0);
+		ret = open_image_cipher(&cipher_handle, use_aes);
 		if (ret) {
 			suspend_error("libgcrypt error %s", gcry_strerror(ret));
 			do_encrypt = 0;
-		} else {
-			encrypt_buf_size = ENCRYPT_BUF_PAGES * page_size;
-			mem_size += encrypt_buf_size;
 		}
 	}
 #endif
-	if (use_threads) {
-		mem_size += (compress_buf_size > 0) ?
-				(WRITE_BUFFERS - 1) * compress_buf_size :
-				WRITE_BUFFERS * buffer_size;
-		if (!do_encrypt)
-			mem_size += WRITE_BUFFERS * buffer_size;
-	}
-
-	ret = init_memalloc(page_size, mem_size);
+	/*
+	 * The image header is allocated before the structures used for saving
+	 * the image and they are freed before the image is verified.
+	 */
+	mem_size = swap_writer_mem_size();
+	verify_mem_size = swap_reader_mem_size(do_compress, sparse_pages,
+			dedup_pages, decompress_work_size);
+	if (mem_size < verify_mem_size)
+		mem_size = verify_mem_size;
+	mem_size += page_size;
+
+	ret = init_memalloc(mem_size);
 	if (ret) {
 		suspend_error("Could not allocate memory.");
 		return ret;
@@ -2648,6 +3419,7 @@ Umount:
 	if (do_encrypt)
 		gcry_cipher_close(cipher_handle);
 #endif
+	print_memalloc_stats();
 	free_memalloc();
 
 	return ret;
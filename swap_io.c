@@ -0,0 +1,757 @@
+/*
+ * swap_io.c
+ *
+ * Merging of reads and writes of consecutive swap pages into large I/O
+ * requests, so that a run of pages within an extent takes one system call
+ * instead of two per page.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include "config.h"
+
+/* O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef CONFIG_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "swsusp.h"
+#include "memalloc.h"
+#include "swap_io.h"
+
+/* Upper limit on the size of a single I/O request, in KB */
+unsigned int swap_io_size = SWAP_IO_SIZE;
+/* Number of write requests to keep in flight with io_uring (0 - don't use it) */
+unsigned int swap_io_depth = SWAP_IO_DEPTH;
+/* If set, image data are transferred with O_DIRECT, bypassing the page cache */
+char swap_io_direct = 1;
+/* Upper limit on the amount of data being written back early, in KB */
+unsigned int swap_writeout_window = SWAP_WRITEOUT_WINDOW;
+
+#ifdef CONFIG_IO_URING
+/*
+ * The io_uring instance is driven with the raw system calls, so there is no
+ * need for liburing.  One thread (the one writing the image) fills the
+ * submission queue and the reaper thread of the ring takes entries from the
+ * completion queue, so neither of the queues is shared between threads.
+ */
+
+/* user_data of the request making the reaper thread exit */
+#define REAPER_EXIT	((__u64)-1)
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+/**
+ *	swap_ring_supported - check if the kernel supports io_uring
+ */
+int swap_ring_supported(void)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = io_uring_setup(1, &p);
+	if (fd < 0)
+		return 0;
+	close(fd);
+	return 1;
+}
+
+static void unmap_rings(struct swap_ring *ring)
+{
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/**
+ *	submit - pass the submission queue entry at the tail to the kernel
+ */
+static int submit(struct swap_ring *ring, struct io_uring_sqe *sqe)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	int ret;
+
+	ring->sqes[index] = *sqe;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	do
+		ret = io_uring_enter(ring->fd, 1, 0, 0);
+	while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -errno : 0;
+}
+
+/**
+ *	busy_period - time since @ring has last started to have requests in
+ *		flight, in microseconds
+ */
+static unsigned long busy_period(struct swap_ring *ring)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &ring->busy_start, &now);
+	return now.tv_sec * 1000000UL + now.tv_usec;
+}
+
+/**
+ *	complete - finish a request and put it back on the list of unused ones
+ */
+static void complete(struct swap_ring *ring, int r, int error)
+{
+	struct swap_request *req = ring->requests + r;
+
+	ring->put(req->tag, error, ring->data);
+	pthread_mutex_lock(&ring->lock);
+	if (error && !ring->error)
+		ring->error = error;
+	if (!error)
+		ring->nr_bytes += req->iov.iov_len;
+	req->next_free = ring->free_request;
+	ring->free_request = r;
+	if (!--ring->in_flight)
+		ring->busy_time += busy_period(ring);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void *reaper_thread(void *arg)
+{
+	struct swap_ring *ring = arg;
+
+	for (;;) {
+		unsigned int head = *ring->cq_head;
+		struct io_uring_cqe *cqe;
+		__u64 user_data;
+		int res, error;
+
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+		cqe = ring->cqes + (head & *ring->cq_mask);
+		user_data = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (user_data == REAPER_EXIT)
+			break;
+		if (res < 0)
+			error = res;
+		else if ((size_t)res < ring->requests[user_data].iov.iov_len)
+			error = -EIO;
+		else
+			error = 0;
+		/* Only data that have been written can be written back */
+		if (!error && ring->requests[user_data].writeout)
+			swap_writeout_add(ring->requests[user_data].writeout,
+					ring->requests[user_data].offset, res);
+		complete(ring, user_data, error);
+	}
+	return NULL;
+}
+
+/**
+ *	swap_ring_init - set up an io_uring instance and start its reaper thread
+ *	@depth:	Maximum number of requests in flight (SWAP_RING_REQUESTS at
+ *		most).
+ *	@get:	Called for every request submitted, with its tag.
+ *	@put:	Called for every request completed, with its tag, error code
+ *		and @data.
+ *
+ *	Return a negative error code if io_uring cannot be used, in which case
+ *	the I/O should be carried out synchronously.
+ */
+int swap_ring_init(struct swap_ring *ring, unsigned int depth,
+			void (*get)(void *), void (*put)(void *, int, void *),
+			void *data)
+{
+	struct io_uring_params p;
+	int j, error;
+
+	if (depth > SWAP_RING_REQUESTS)
+		depth = SWAP_RING_REQUESTS;
+	memset(ring, 0, sizeof(*ring));
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+	memset(&p, 0, sizeof(p));
+	/* One more entry for the request making the reaper thread exit */
+	ring->fd = io_uring_setup(depth + 1, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array +
+				p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+				p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto Fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto Fail;
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto Fail;
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_ring +
+						p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring +
+						p.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_ring +
+						p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+						p.cq_off.cqes);
+
+	ring->depth = depth;
+	for (j = 0; j < SWAP_RING_REQUESTS - 1; j++)
+		ring->requests[j].next_free = j + 1;
+	ring->requests[j].next_free = -1;
+	ring->free_request = 0;
+	ring->get = get;
+	ring->put = put;
+	ring->data = data;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	error = pthread_create(&ring->reaper, NULL, reaper_thread, ring);
+	if (!error)
+		return 0;
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	errno = error;
+ Fail:
+	error = -errno;
+	unmap_rings(ring);
+	close(ring->fd);
+	return error;
+}
+
+/**
+ *	swap_ring_submit - start reading or writing a memory area
+ *	@fd:		File handle associated with the swap.
+ *	@write:		Set if the area is to be written.
+ *	@buf:		The area.
+ *	@len:		Size of the area.
+ *	@offset:	Swap offset to transfer the area to or from.
+ *	@tag:		Passed to the get() and put() callbacks of @ring.
+ *	@wo:		If set, the area is added to this writeback window when
+ *			it has been written.
+ *
+ *	Wait for a request to complete if there are too many of them in flight.
+ *	If the request cannot be submitted, put() is called for @tag before
+ *	returning the error code.
+ */
+int swap_ring_submit(struct swap_ring *ring, int fd, int write, void *buf,
+			size_t len, loff_t offset, void *tag,
+			struct swap_writeout *wo)
+{
+	struct swap_request *req;
+	struct io_uring_sqe sqe;
+	int r, error;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->in_flight >= ring->depth)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	r = ring->free_request;
+	req = ring->requests + r;
+	ring->free_request = req->next_free;
+	if (!ring->in_flight)
+		gettimeofday(&ring->busy_start, NULL);
+	if (++ring->in_flight > ring->max_in_flight)
+		ring->max_in_flight = ring->in_flight;
+	ring->nr_requests++;
+	pthread_mutex_unlock(&ring->lock);
+
+	req->iov.iov_base = buf;
+	req->iov.iov_len = len;
+	req->offset = offset;
+	req->writeout = write ? wo : NULL;
+	req->tag = tag;
+	ring->get(tag);
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.addr = (unsigned long)&req->iov;
+	sqe.len = 1;
+	sqe.user_data = r;
+	error = submit(ring, &sqe);
+	if (error)
+		complete(ring, r, error);
+	return error;
+}
+
+/**
+ *	swap_ring_drain - wait until all of the requests in flight are complete
+ *
+ *	Return the error code of the first failing request, if any.
+ */
+int swap_ring_drain(struct swap_ring *ring)
+{
+	int error;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->in_flight > 0)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	error = ring->error;
+	pthread_mutex_unlock(&ring->lock);
+	return error;
+}
+
+/**
+ *	swap_ring_busy - get the time @ring has had requests in flight
+ *	@bytes:	Return the number of bytes transferred by the completed requests.
+ *
+ *	Return the time in microseconds.  Periods with no requests in flight are
+ *	not counted, so the time divided by @bytes is how long the device takes
+ *	to transfer a byte (unlike the time spent in swap_ring_submit()).
+ */
+unsigned long swap_ring_busy(struct swap_ring *ring, unsigned long *bytes)
+{
+	unsigned long busy;
+
+	pthread_mutex_lock(&ring->lock);
+	busy = ring->busy_time;
+	if (ring->in_flight)
+		busy += busy_period(ring);
+	*bytes = ring->nr_bytes;
+	pthread_mutex_unlock(&ring->lock);
+	return busy;
+}
+
+/**
+ *	swap_ring_exit - wait for the requests in flight and tear down @ring
+ */
+void swap_ring_exit(struct swap_ring *ring)
+{
+	struct io_uring_sqe sqe;
+
+	swap_ring_drain(ring);
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_NOP;
+	sqe.user_data = REAPER_EXIT;
+	if (submit(ring, &sqe))
+		pthread_cancel(ring->reaper);
+	pthread_join(ring->reaper, NULL);
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	unmap_rings(ring);
+	close(ring->fd);
+}
+#endif /* CONFIG_IO_URING */
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+
+/**
+ *	pwrite_dsync - write a page with RWF_DSYNC
+ *
+ *	Return the number of bytes written or -1 and set errno.
+ */
+static ssize_t pwrite_dsync(int fd, void *buf, loff_t offset)
+{
+#ifdef SYS_pwritev2
+	struct iovec iov;
+	ssize_t cnt;
+
+	iov.iov_base = buf;
+	iov.iov_len = page_size;
+	do
+		cnt = syscall(SYS_pwritev2, fd, &iov, 1, (unsigned long)offset,
+				(unsigned long)((uint64_t)offset >> 32),
+				RWF_DSYNC);
+	while (cnt < 0 && errno == EINTR);
+	return cnt;
+#else
+	(void)fd;
+	(void)buf;
+	(void)offset;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ *	swap_io_write_sync - write data to the swap and make them durable
+ *			without flushing the whole cache of the device
+ *	@fd:		File handle associated with the swap.
+ *	@data:		Data to write.
+ *	@size:		Number of bytes to write (they must not cross a page
+ *			boundary).
+ *	@offset:	Where to write the data.
+ *
+ *	The page holding the data is read, updated and written back as a whole
+ *	with RWF_DSYNC.  If the page can be written with O_DIRECT, the kernel
+ *	makes it durable with a FUA write, so only that page has to reach the
+ *	storage medium, instead of everything in the device cache.  Without
+ *	RWF_DSYNC, the data are written and synced with fdatasync().
+ */
+int swap_io_write_sync(int fd, const void *data, size_t size, loff_t offset)
+{
+	loff_t start = offset - offset % page_size;
+	ssize_t cnt = -1;
+	char *page;
+	int direct, error = 0;
+
+	page = getmem(page_size);
+	if (!page)
+		goto Fallback;
+	if (pread(fd, page, page_size, start) != (ssize_t)page_size) {
+		freemem(page);
+		return -EIO;
+	}
+	memcpy(page + (offset - start), data, size);
+	direct = swap_io_set_direct(fd, 1);
+	cnt = pwrite_dsync(fd, page, start);
+	if (cnt < 0 && errno == EINVAL && direct) {
+		/* The device may refuse O_DIRECT */
+		swap_io_set_direct(fd, 0);
+		direct = 0;
+		cnt = pwrite_dsync(fd, page, start);
+	}
+	if (cnt < 0)
+		error = -errno;
+	if (direct)
+		swap_io_set_direct(fd, 0);
+	freemem(page);
+	if (cnt == (ssize_t)page_size)
+		return 0;
+	if (cnt >= 0)
+		return -EIO;
+	if (error != -ENOSYS && error != -EOPNOTSUPP && error != -EINVAL)
+		return error;
+
+ Fallback:
+	/* RWF_DSYNC is not supported, so flush the device cache */
+	if (pwrite(fd, data, size, offset) != (ssize_t)size)
+		return -EIO;
+	return fdatasync(fd) ? -errno : 0;
+}
+
+/**
+ *	swap_io_set_direct - switch a swap file handle to or from O_DIRECT
+ *	@fd:		File handle associated with the swap.
+ *	@direct:	Whether or not to use O_DIRECT.
+ *
+ *	All of the image I/O is done in page-aligned units of whole pages from
+ *	buffers allocated with getmem(), which are page-aligned too, so it can
+ *	bypass the page cache unless the device's sectors are larger than a
+ *	page.  Return 1 if O_DIRECT is in effect for @fd afterwards.
+ */
+int swap_io_set_direct(int fd, int direct)
+{
+	int flags, sector_size;
+
+	if (direct && (ioctl(fd, BLKSSZGET, &sector_size) ||
+	    sector_size <= 0 || (unsigned int)sector_size > page_size))
+		return 0;
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return 0;
+	flags = direct ? flags | O_DIRECT : flags & ~O_DIRECT;
+	if (fcntl(fd, F_SETFL, flags))
+		return 0;
+	return !!direct;
+}
+
+/**
+ *	drop_direct - stop using O_DIRECT for @fd if it is used
+ *
+ *	Return 1 if O_DIRECT has been in effect for @fd.
+ */
+static int drop_direct(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || !(flags & O_DIRECT))
+		return 0;
+	return !fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+/**
+ *	swap_io_init - prepare an empty batch of swap pages
+ *	@io:		Batch to initialize.
+ *	@fd:		File handle associated with the swap.
+ *	@write:		Set if the pages are to be written.
+ */
+void swap_io_init(struct swap_io *io, int fd, int write)
+{
+	io->fd = fd;
+	io->write = write;
+	io->size = 0;
+	io->nr_vecs = 0;
+	io->ring = NULL;
+	io->tag = NULL;
+	io->writeout = NULL;
+	io->max_size = (size_t)swap_io_size * 1024;
+	io->max_size -= io->max_size % page_size;
+	if (io->max_size < page_size)
+		io->max_size = page_size;
+}
+
+/**
+ *	swap_io_flush - read or write the pages in the batch
+ *	@io:	The batch.
+ *
+ *	The batch is empty afterwards, even if the I/O has failed.  If @io->ring
+ *	is set, the I/O is only started.
+ */
+int swap_io_flush(struct swap_io *io)
+{
+	struct iovec *iov = io->iov;
+	int nr_vecs = io->nr_vecs;
+	loff_t offset = io->offset;
+	size_t left = io->size;
+	int error = 0;
+
+#ifdef CONFIG_IO_URING
+	if (io->ring) {
+		for (; nr_vecs > 0 && !error; iov++, nr_vecs--) {
+			error = swap_ring_submit(io->ring, io->fd, io->write,
+					iov->iov_base, iov->iov_len, offset,
+					io->tag, io->writeout);
+			offset += iov->iov_len;
+		}
+		io->size = 0;
+		io->nr_vecs = 0;
+		return error;
+	}
+#endif
+	while (left > 0) {
+		ssize_t cnt;
+
+		if (io->write)
+			cnt = pwritev(io->fd, iov, nr_vecs, offset);
+		else
+			cnt = preadv(io->fd, iov, nr_vecs, offset);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		/* The device may refuse O_DIRECT, fall back to buffered I/O */
+		if (cnt < 0 && errno == EINVAL && drop_direct(io->fd))
+			continue;
+		if (cnt <= 0) {
+			error = -EIO;
+			break;
+		}
+		/* Short transfer, skip the part that's been done */
+		offset += cnt;
+		left -= cnt;
+		while (nr_vecs > 0 && (size_t)cnt >= iov->iov_len) {
+			cnt -= iov->iov_len;
+			iov++;
+			nr_vecs--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + cnt;
+			iov->iov_len -= cnt;
+		}
+	}
+	if (!error && io->write && io->writeout && io->size > 0)
+		swap_writeout_add(io->writeout, io->offset, io->size);
+	io->size = 0;
+	io->nr_vecs = 0;
+	return error;
+}
+
+/**
+ *	swap_writeout_init - prepare an empty writeback window
+ *	@wo:	Window to initialize.
+ *	@fd:	File handle associated with the swap.
+ */
+void swap_writeout_init(struct swap_writeout *wo, int fd)
+{
+	wo->fd = fd;
+	wo->first = 0;
+	wo->nr_ranges = 0;
+	wo->pending.size = 0;
+	wo->in_flight = 0;
+	wo->window = (size_t)swap_writeout_window * 1024;
+	if (wo->window < 4 * page_size)
+		wo->window = 4 * page_size;
+	/* Keep a few chunks under writeback, so that the device never idles */
+	wo->chunk = round_down_page_size(wo->window / 4);
+	wo->nr_waits = 0;
+}
+
+/**
+ *	wait_oldest - wait until the oldest range in the window has been written
+ *			back and drop it from the window
+ */
+static void wait_oldest(struct swap_writeout *wo)
+{
+	struct swap_range *r = wo->ranges + wo->first;
+
+	if (wo->fd >= 0 && sync_range(wo->fd, r->offset, r->size,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER))
+		wo->fd = -1;
+	wo->in_flight -= r->size;
+	wo->first = (wo->first + 1) % SWAP_WRITEOUT_RANGES;
+	wo->nr_ranges--;
+	wo->nr_waits++;
+}
+
+/**
+ *	start_pending - start the writeback of the pending range
+ */
+static void start_pending(struct swap_writeout *wo)
+{
+	struct swap_range *r;
+
+	if (!wo->pending.size)
+		return;
+	if (wo->nr_ranges == SWAP_WRITEOUT_RANGES)
+		wait_oldest(wo);
+	if (wo->fd < 0 || sync_range(wo->fd, wo->pending.offset,
+				wo->pending.size, SYNC_FILE_RANGE_WRITE)) {
+		/* Leave the rest to fsync() */
+		wo->fd = -1;
+		return;
+	}
+	r = wo->ranges + (wo->first + wo->nr_ranges) % SWAP_WRITEOUT_RANGES;
+	*r = wo->pending;
+	wo->nr_ranges++;
+	wo->pending.size = 0;
+}
+
+/**
+ *	swap_writeout_add - add data that have just been written to the window
+ *	@wo:		The window.
+ *	@offset:	Swap offset of the data.
+ *	@size:		Number of bytes written.
+ *
+ *	If there are too many data under writeback, wait for the oldest of them
+ *	to reach the storage.
+ */
+void swap_writeout_add(struct swap_writeout *wo, loff_t offset, size_t size)
+{
+	if (wo->fd < 0)
+		return;
+	if (wo->pending.size &&
+	    offset != wo->pending.offset + wo->pending.size)
+		start_pending(wo);
+	if (!wo->pending.size)
+		wo->pending.offset = offset;
+	wo->pending.size += size;
+	wo->in_flight += size;
+	if ((size_t)wo->pending.size >= wo->chunk)
+		start_pending(wo);
+	while (wo->in_flight > wo->window && wo->nr_ranges > 0)
+		wait_oldest(wo);
+}
+
+/**
+ *	swap_writeout_finish - start the writeback of everything in the window
+ *
+ *	The data under writeback are left for fsync() to wait for.
+ */
+void swap_writeout_finish(struct swap_writeout *wo)
+{
+	if (wo->fd >= 0)
+		start_pending(wo);
+}
+
+/**
+ *	swap_io_wait - wait for the I/O started by swap_io_flush() to complete
+ *	@io:	The batch.
+ *
+ *	Return the error code of the first failing request, if any.
+ */
+int swap_io_wait(struct swap_io *io)
+{
+#ifdef CONFIG_IO_URING
+	if (io->ring)
+		return swap_ring_drain(io->ring);
+#endif
+	(void)io;
+	return 0;
+}
+
+/**
+ *	swap_io_add - add a page to the batch
+ *	@io:		The batch.
+ *	@buf:		Memory area to transfer the page from or to.
+ *	@offset:	Swap offset of the page.
+ *
+ *	If the page cannot be merged with the batch, flush the batch first.
+ */
+int swap_io_add(struct swap_io *io, void *buf, loff_t offset)
+{
+	struct iovec *last;
+	int error;
+
+	if (!offset)
+		return -EINVAL;
+
+	if (io->size > 0 && (offset != io->offset + (loff_t)io->size ||
+	    io->size + page_size > io->max_size)) {
+		error = swap_io_flush(io);
+		if (error)
+			return error;
+	}
+	if (!io->size)
+		io->offset = offset;
+	last = io->iov + io->nr_vecs - 1;
+	if (io->nr_vecs > 0 &&
+	    (char *)last->iov_base + last->iov_len == (char *)buf) {
+		last->iov_len += page_size;
+	} else {
+		if (io->nr_vecs == SWAP_IO_VECS) {
+			error = swap_io_flush(io);
+			if (error)
+				return error;
+			io->offset = offset;
+		}
+		io->iov[io->nr_vecs].iov_base = buf;
+		io->iov[io->nr_vecs].iov_len = page_size;
+		io->nr_vecs++;
+	}
+	io->size += page_size;
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * swap_io.h
+ *
+ * Definitions of the helpers merging reads and writes of consecutive swap
+ * pages into large I/O requests.
+ *
+ * This file is released under the GPLv2.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef CONFIG_IO_URING
+#include <sys/time.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Default upper limit on the size of a single I/O request, in KB */
+#define SWAP_IO_SIZE	1024
+
+#define SWAP_IO_VECS	64
+
+/* Default number of write requests to keep in flight with io_uring */
+#define SWAP_IO_DEPTH	4
+#define SWAP_IO_DEPTH_MAX	32
+
+/* Default upper limit on the amount of image data being written back, in KB */
+#define SWAP_WRITEOUT_WINDOW	(16 * 1024)
+
+#define SWAP_WRITEOUT_RANGES	32
+
+/**
+ *	struct swap_range - contiguous part of the swap
+ */
+struct swap_range {
+	loff_t offset;
+	loff_t size;
+};
+
+/**
+ *	struct swap_writeout - sliding window of image data being written back
+ *	@fd:		File handle associated with the swap, or -1 if the
+ *			writeback cannot be controlled.
+ *	@ranges:	Ranges whose writeback has been started, oldest first.
+ *	@first:		Index of the oldest entry of @ranges.
+ *	@nr_ranges:	Number of entries of @ranges in use.
+ *	@pending:	Range that has been written, but whose writeback hasn't
+ *			been started yet.  It grows as long as the data written
+ *			next are adjacent to it.
+ *	@in_flight:	Number of bytes in @ranges and @pending.
+ *	@window:	Upper limit on @in_flight.
+ *	@chunk:		Size at which the writeback of @pending is started.
+ *	@nr_waits:	Number of times the writer has waited for writeback.
+ *
+ *	Instead of syncing the whole device every now and then, the writeback
+ *	of every chunk of data is started right after the chunk has been
+ *	written, and once there are more than @window bytes under writeback,
+ *	the writer waits for the oldest chunks to reach the storage.  Thus the
+ *	writer is paced by the storage and the final fsync() has little left
+ *	to do.  With io_uring the chunks are added to the window as their
+ *	writes complete, by the reaper thread of the ring, which is then paced
+ *	by the storage instead.
+ */
+struct swap_writeout {
+	int fd;
+	struct swap_range ranges[SWAP_WRITEOUT_RANGES];
+	unsigned int first;
+	unsigned int nr_ranges;
+	struct swap_range pending;
+	size_t in_flight;
+	size_t window;
+	size_t chunk;
+	unsigned long nr_waits;
+};
+
+#ifdef CONFIG_IO_URING
+/*
+ * Each request holds one block of image data, so there are never more blocks
+ * in flight than requests (a block crossing an extent boundary takes one
+ * request per extent).
+ */
+#define SWAP_RING_REQUESTS	SWAP_IO_DEPTH_MAX
+
+struct swap_request {
+	struct iovec iov;
+	loff_t offset;
+	struct swap_writeout *writeout;
+	void *tag;
+	int next_free;
+};
+
+/**
+ *	struct swap_ring - io_uring instance used for asynchronous swap I/O
+ *	@fd:		File handle of the io_uring instance.
+ *	@depth:		Maximum number of requests in flight.
+ *	@in_flight:	Number of requests in flight.
+ *	@max_in_flight:	The greatest value @in_flight has reached.
+ *	@nr_requests:	Number of requests submitted.
+ *	@busy_start:	When @in_flight has last become nonzero.
+ *	@busy_time:	Total time with requests in flight, in microseconds,
+ *			not including the current period.
+ *	@nr_bytes:	Number of bytes transferred by the completed requests.
+ *	@error:		Error code of the first failing request.
+ *	@requests:	Requests in flight, indexed by the user_data of their
+ *			submission and completion queue entries.
+ *	@free_request:	Index of the first unused entry of @requests.
+ *	@get:		Called with the tag passed to swap_ring_submit() when
+ *			the request is submitted.
+ *	@put:		Called with the same tag and the error code of the
+ *			request when it is complete.
+ *	@data:		Passed to @put.
+ *	@reaper:	Thread handling completions.
+ *
+ *	@lock protects @in_flight, the statistics, @error and the list of
+ *	unused requests.
+ *	The submission queue must only be used by one thread at a time.
+ */
+struct swap_ring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int depth;
+	unsigned int in_flight;
+	unsigned int max_in_flight;
+	unsigned long nr_requests;
+	struct timeval busy_start;
+	unsigned long busy_time;
+	unsigned long nr_bytes;
+	int error;
+	struct swap_request requests[SWAP_RING_REQUESTS];
+	int free_request;
+	void (*get)(void *tag);
+	void (*put)(void *tag, int error, void *data);
+	void *data;
+	pthread_t reaper;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int swap_ring_supported(void);
+int swap_ring_init(struct swap_ring *ring, unsigned int depth,
+			void (*get)(void *), void (*put)(void *, int, void *),
+			void *data);
+int swap_ring_submit(struct swap_ring *ring, int fd, int write, void *buf,
+			size_t len, loff_t offset, void *tag,
+			struct swap_writeout *wo);
+int swap_ring_drain(struct swap_ring *ring);
+unsigned long swap_ring_busy(struct swap_ring *ring, unsigned long *bytes);
+void swap_ring_exit(struct swap_ring *ring);
+#endif
+
+/**
+ *	struct swap_io - batch of swap pages to be read or written at once
+ *	@fd:		File handle associated with the swap.
+ *	@write:		Set if the pages are to be written, clear if read.
+ *	@offset:	Swap offset of the first page in the batch.
+ *	@size:		Number of bytes in the batch.
+ *	@max_size:	Upper limit on @size.
+ *	@iov:		Memory areas the batch is transferred from or to.
+ *	@nr_vecs:	Number of entries in @iov actually used.
+ *	@ring:		If set, the batch is submitted to this io_uring instance
+ *			instead of being transferred synchronously.
+ *	@tag:		Passed to swap_ring_submit() along with the batch.
+ *	@writeout:	If set, the writeback of the data written is controlled
+ *			with this window.  If @ring is set, the data are added
+ *			to the window by the reaper thread of the ring when
+ *			their writes are complete.
+ *
+ *	Pages are added to the batch as long as they are adjacent to it in the
+ *	swap, which is only possible within one extent.  The memory areas
+ *	passed to swap_io_add() must not be touched until the batch has been
+ *	flushed or, if @ring is set, until the ring's put() callback has been
+ *	called for @tag as many times as get().
+ */
+struct swap_io {
+	int fd;
+	int write;
+	loff_t offset;
+	size_t size;
+	size_t max_size;
+	struct iovec iov[SWAP_IO_VECS];
+	int nr_vecs;
+	struct swap_ring *ring;
+	void *tag;
+	struct swap_writeout *writeout;
+};
+
+extern unsigned int swap_io_size;
+extern unsigned int swap_io_depth;
+extern char swap_io_direct;
+extern unsigned int swap_writeout_window;
+
+int swap_io_set_direct(int fd, int direct);
+int swap_io_write_sync(int fd, const void *data, size_t size, loff_t offset);
+void swap_io_init(struct swap_io *io, int fd, int write);
+int swap_io_add(struct swap_io *io, void *buf, loff_t offset);
+int swap_io_flush(struct swap_io *io);
+int swap_io_wait(struct swap_io *io);
+void swap_writeout_init(struct swap_writeout *wo, int fd);
+void swap_writeout_add(struct swap_writeout *wo, loff_t offset, size_t size);
+void swap_writeout_finish(struct swap_writeout *wo);
@@ -10,11 +10,13 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <linux/fs.h>
 #include <linux/suspend_ioctls.h>
 #include <errno.h>
 
 #include "encrypt.h"
+#include "compress.h"
 
 #define	LINUX_REBOOT_MAGIC1	0xfee1dead
 #define	LINUX_REBOOT_MAGIC2	672274793
@@ -55,6 +57,19 @@ struct swsusp_info {
 #define PMOPS_ENTER	2
 #define PMOPS_FINISH	3
 
+/*
+ * Maximum number of pages taken by the extent map.  Images with more
+ * fragmented swap only have the chain of extents pages starting at map_start.
+ */
+#define IMAGE_MAP_PAGES	64
+
+/*
+ * Maximum number of pages taken by the block index.  Every compressed block
+ * is described by two varints in it: the number of image data pages in the
+ * block and the number of swap pages taken by the block minus one.
+ */
+#define IMAGE_INDEX_PAGES	32
+
 struct image_header_info {
 	unsigned long		pages;
 	uint32_t		flags;
@@ -68,6 +83,17 @@ struct image_header_info {
 #endif
 	double			writeout_time;
 	int			resume_pause;
+	/* Zero for images compressed with LZO (or not compressed at all) */
+	int			compress_method;
+	int			compress_level;
+	/* Zero for images checksummed with MD5 (or not checksummed at all) */
+	int			checksum_method;
+	/* Size of the extent map and the swap pages holding it (IMAGE_MAP) */
+	uint32_t		map_size;
+	loff_t			map_pages[IMAGE_MAP_PAGES];
+	/* Size of the block index and the swap pages holding it */
+	uint32_t		index_size;
+	loff_t			index_pages[IMAGE_INDEX_PAGES];
 };
 
 #define IMAGE_CHECKSUM		0x0001
@@ -75,6 +101,14 @@ struct image_header_info {
 #define IMAGE_ENCRYPTED		0x0004
 #define IMAGE_USE_RSA		0x0008
 #define PLATFORM_SUSPEND	0x0010
+#define IMAGE_SPARSE_PAGES	0x0020
+#define IMAGE_DEDUP_PAGES	0x0040
+#define IMAGE_BLOCK_CHECKSUM	0x0080
+#define IMAGE_AES_CTR		0x0100
+#define IMAGE_MAP		0x0200
+#define IMAGE_BLOCK_INDEX	0x0400
+/* The compressed blocks have the header with flags (struct buf_block) */
+#define IMAGE_BLOCK_FLAGS	0x0800
 
 #define SWSUSP_SIG	"ULSUSPEND"
 
@@ -130,14 +164,29 @@ static inline void power_off(void)
  #ifdef __x86_64__
   #define SYS_sync_file_range	277
  #endif
- #define SYNC_FILE_RANGE_WRITE	2
+#endif
+#ifndef __always_inline
+#define __always_inline	inline __attribute__((always_inline))
 #endif
 
-static inline int start_writeout(int fd)
+#ifndef SYNC_FILE_RANGE_WRITE
+ #define SYNC_FILE_RANGE_WAIT_BEFORE	1
+ #define SYNC_FILE_RANGE_WRITE		2
+ #define SYNC_FILE_RANGE_WAIT_AFTER	4
+#endif
+
+/**
+ *	sync_range - start and/or wait for the writeback of a part of a file
+ *	@fd:		File handle.
+ *	@offset:	Start of the part.
+ *	@nbytes:	Size of the part (0 - up to the end of the file).
+ *	@flags:		SYNC_FILE_RANGE_* flags.
+ */
+static inline int sync_range(int fd, loff_t offset, loff_t nbytes,
+				unsigned int flags)
 {
 #ifdef SYS_sync_file_range
-	return syscall(SYS_sync_file_range, fd,
-			(loff_t)0, (loff_t)0, SYNC_FILE_RANGE_WRITE);
+	return syscall(SYS_sync_file_range, fd, offset, nbytes, flags);
 #else
 	errno = ENOSYS;
 	return -1;
@@ -149,12 +198,42 @@ struct extent {
 	loff_t end;
 };
 
-/* The number 1 below is arbitrary.  The actual size of data[] is variable */
+/*
+ * The number 1 below is arbitrary.  The actual size of data[] is variable.
+ *
+ * The block header used to be a single size_t.  Images with the current
+ * header have IMAGE_BLOCK_FLAGS set in the image header.  Compressed images
+ * without it are only loaded on 64-bit little-endian systems, where the old
+ * header looks like the current one with no flags set.
+ */
 struct buf_block {
-	size_t size;
+	uint32_t size;
+	uint32_t flags;
 	char data[1];
 } __attribute__((packed));
 
+/* The data in the block are stored as is (not compressed) */
+#define BUF_BLOCK_RAW	0x0001
+
+/*
+ * The compression level the data in the block have been compressed with, or 0
+ * if it is not recorded (s2disk may choose a different level for every block,
+ * see "compress level max").  The decompressors don't need to know it.
+ */
+#define BUF_BLOCK_LEVEL_SHIFT	8
+#define BUF_BLOCK_LEVEL_MASK	0xff00
+#define BUF_BLOCK_LEVELS	256
+#define BUF_BLOCK_LEVEL(flags)	\
+	(((flags) & BUF_BLOCK_LEVEL_MASK) >> BUF_BLOCK_LEVEL_SHIFT)
+
+#define BUF_BLOCK_HEADER_SIZE	offsetof(struct buf_block, data)
+
+/*
+ * If the IMAGE_BLOCK_CHECKSUM header flag is set, the data in each block are
+ * followed by the 64-bit checksum of the block header and data.
+ */
+#define BUF_BLOCK_CHECKSUM_SIZE	sizeof(uint64_t)
+
 #define SNAPSHOT_DEVICE	"/dev/snapshot"
 #define RESUME_DEVICE ""
 
@@ -171,16 +250,33 @@ struct buf_block {
 
 #define WRITE_BUFFERS	4
 
+#define READ_BUFFERS	4
+
+#define COMPRESS_THREADS_MAX	16
+
+#define DECOMPRESS_THREADS_MAX	16
+
 extern char *my_name;
 
 #ifdef CONFIG_COMPRESS
 extern unsigned int compress_buf_size;
+unsigned int block_buffer_size(size_t bound);
 #else
-#define LZO1X_1_MEM_COMPRESS 0
 #define compress_buf_size 0
 #endif
 
+#ifdef CONFIG_THREADS
+extern unsigned int nr_read_buffers;
+extern int decompress_threads;
+#else
+#define nr_read_buffers 1
+#define decompress_threads 0
+#endif
+
 #define MIN_TEST_IMAGE_PAGES	1024
 
+size_t swap_reader_mem_size(int compressed, int unpack, int dedup,
+				size_t work_size);
 int read_or_verify(int dev, int fd, struct image_header_info *header,
                    loff_t start, int verify, int test);
+void print_memalloc_stats(void);